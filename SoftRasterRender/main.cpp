@@ -3,36 +3,32 @@
 #include "renderengine/include/irenderengine.h"
 #include "renderengine/include/iobject.h"
 #include "geometry.h"
+#include <map>
 
 constexpr int g_width = 800;
 constexpr int g_height = 800;
 
-// 利用Bresenham算法绘制人脸网格
+// 批量绘制人脸网格，共享的边只绘制一次，顶点变换使用引擎当前的着色器
 void drawFaceGrid(IModel* pIModel, IRasterRenderEngin* engine)
 {
+	std::vector<Vec3f> verts(pIModel->nverts());
+	for (int i = 0; i < pIModel->nverts(); ++i)
+	{
+		verts[i] = pIModel->vert(i);
+	}
+
+	std::vector<int> indices;
+	indices.reserve(pIModel->nfaces() * 3);
 	for (int i = 0; i < pIModel->nfaces(); ++i)
 	{
 		auto faceVertIndex = pIModel->faceVertIndex(i);
-
-		for (int j = 0; j < 3; ++j)
-		{
-			Vec3f v0 = pIModel->vert(faceVertIndex[j]);
-			Vec3f v1 = pIModel->vert(faceVertIndex[(j + 1) % 3]);
-
-			int x0 = (int)std::round((v0.x + 1.) * g_width / 2);
-			int y0 = (int)std::round((v0.y + 1.) * g_height / 2);
-			int x1 = (int)std::round((v1.x + 1.) * g_width / 2);
-			int y1 = (int)std::round((v1.y + 1.) * g_height / 2);
-
-			// 避免临界条件
-			x0 = std::clamp(x0, 0, g_width - 1);
-			y0 = std::clamp(y0, 0, g_height - 1);
-			x1 = std::clamp(x1, 0, g_width - 1);
-			y1 = std::clamp(y1, 0, g_height - 1);
-
-			engine->drawLine(x0, y0, x1, y1, TGAColor(255, 255, 255, 255));
-		}
+		indices.insert(indices.end(), faceVertIndex.begin(), faceVertIndex.begin() + 3);
 	}
+
+	IShader::VertexStreams vertexStreams;
+	vertexStreams.pVert = verts.data();
+	vertexStreams.count = (int)verts.size();
+	engine->drawWireframe(vertexStreams, indices.data(), (int)indices.size(), TGAColor(255, 255, 255, 255));
 }
 
 void loadTex(IShader* pIShader)
@@ -80,46 +76,139 @@ void drawFaceTriangle(IModel* pIModel, IRasterRenderEngin* engine)
 	}
 }
 
-class GouraudShader : public IShader
+// 合并成索引网格后绘制，共享的顶点只做一次顶点着色
+// 着色器类型在编译期确定，顶点、片段着色器直接内联到光栅化循环中
+template<class ShaderT>
+void drawFaceIndexed(IModel* pIModel, IRasterRenderEngin* engine, ShaderT& shader)
+{
+	// obj的位置、纹理、法线各自有索引，三者都相同的才是同一个顶点
+	std::map<std::tuple<int, float, float, float, float, float>, int> vertexMap;
+	std::vector<Vec3f> verts;
+	std::vector<Vec2f> uvs;
+	std::vector<Vec3f> norms;
+	std::vector<Vec3f> tangents;
+	std::vector<Vec3f> bitangents;
+	std::vector<int> indices;
+
+	Vec3f local_coords[3];
+	Vec2f uv_coords[3];
+	Vec3f norm_coords[3];
+	for (int i = 0; i < pIModel->nfaces(); ++i)
+	{
+		auto faceVertIndex = pIModel->faceVertIndex(i);
+
+		for (int j = 0; j < 3; j++)
+		{
+			local_coords[j] = pIModel->vert(faceVertIndex[j]);
+			uv_coords[j] = pIModel->uv(i, j);
+			norm_coords[j] = pIModel->normal(i, j);
+		}
+
+		auto [tangent, bitangent] = engine->computeTangentSpace(local_coords, uv_coords);
+		for (int j = 0; j < 3; j++)
+		{
+			auto key = std::make_tuple(faceVertIndex[j], uv_coords[j].x, uv_coords[j].y, norm_coords[j].x, norm_coords[j].y, norm_coords[j].z);
+			auto item = vertexMap.find(key);
+			int index = 0;
+			if (item == vertexMap.end())
+			{
+				index = (int)verts.size();
+				vertexMap.insert(std::make_pair(key, index));
+				verts.push_back(local_coords[j]);
+				uvs.push_back(uv_coords[j]);
+				norms.push_back(norm_coords[j]);
+				tangents.push_back(Vec3f());
+				bitangents.push_back(Vec3f());
+			}
+			else
+			{
+				index = item->second;
+			}
+
+			// 顶点的切线取相邻三角形的平均
+			tangents[index] = tangents[index] + tangent;
+			bitangents[index] = bitangents[index] + bitangent;
+			indices.push_back(index);
+		}
+	}
+
+	for (size_t i = 0; i < verts.size(); ++i)
+	{
+		tangents[i].normalize();
+		bitangents[i].normalize();
+	}
+
+	IShader::VertexStreams vertexStreams;
+	vertexStreams.pVert = verts.data();
+	vertexStreams.pUV = uvs.data();
+	vertexStreams.pNorm = norms.data();
+	vertexStreams.pTangent = tangents.data();
+	vertexStreams.pBitangent = bitangents.data();
+	vertexStreams.count = (int)verts.size();
+
+	// 先做深度预渲染，再以相等测试着色，每个可见像素只执行一次片段着色器
+	engine->drawDepth(vertexStreams, indices.data(), (int)indices.size());
+	engine->setDepthTest(RasterPipeline::DepthTest::Equal);
+	engine->drawIndexed(shader, vertexStreams, indices.data(), (int)indices.size());
+	engine->setDepthTest(RasterPipeline::DepthTest::Less);
+}
+
+class GouraudShader final : public IShader
 {
 public:
 
 	~GouraudShader() = default;
 
-	virtual VertexOutput vertex(VertexInput vertexInput) override
+	virtual int varyingCount() const override
 	{
-		VertexOutput output;
-		output.pPos.emplace();
-		output.pTexCoord.emplace();
+		return 2; // 纹理坐标
+	}
 
-		if (!vertexInput.pVert || !vertexInput.pUV)
-			return output;
+	virtual bool useDerivatives() const override
+	{
+		return true; // 纹理坐标的差分用于选择mip层级
+	}
 
-		// 转换坐标系
-		for (int i = 0; i < 3; ++i)
-		{
-			output.pPos->at(i) = _transCoords(vertexInput.pVert->at(i));
-			output.pTexCoord->at(i) = vertexInput.pUV->at(i);
-		}
+	virtual Vec4f vertex(const VertexStreams& streams, int index, float* varyings) override
+	{
+		Vec2f uv = streams.pUV ? streams.pUV[index] : Vec2f();
+		varyings[0] = uv[0];
+		varyings[1] = uv[1];
 
-		return output;
+		// 实例化绘制时使用实例的模型矩阵
+		const Matrix& modelMatrix = streams.pInstance ? streams.pInstance->modelMatrix : m_modeMatrix;
+		return _transCoords(streams.pVert[index], modelMatrix); // 转换坐标系
 	}
 
-	virtual bool fragment(FragmentInput fragAttrs, TGAColor& outColor) override
+	virtual bool fragment(const FragmentInput& fragInput, TGAColor& outColor) override
 	{
-		if (fragAttrs.pPixeUV)
-		{
-			outColor = getTexture(fragAttrs.pPixeUV.value(), TextureType::Diffuse);
-		}
-		
+		if (const Texture* pDiffuse = textureSlot(TextureType::Diffuse))
+			outColor = pDiffuse->sampleGrad(fragInput.varying2(0), fragInput.ddx2(0), fragInput.ddy2(0), TextureFilter::Trilinear);
+
 		return false;
 	}
 
+	// 延迟着色：几何阶段只记录纹理坐标与mip层级，光照阶段再采样
+	virtual bool geometry(const FragmentInput& fragInput, SurfaceData& outSurface) override
+	{
+		outSurface.uv = fragInput.varying2(0);
+		if (const Texture* pDiffuse = textureSlot(TextureType::Diffuse))
+			outSurface.lod = pDiffuse->computeLod(fragInput.ddx2(0), fragInput.ddy2(0));
+
+		return false;
+	}
+
+	virtual void lighting(const Vec3f& /*fragCoord*/, const SurfaceData& surface, TGAColor& outColor) override
+	{
+		if (const Texture* pDiffuse = textureSlot(TextureType::Diffuse))
+			outColor = pDiffuse->sample(surface.uv, surface.lod, TextureFilter::Trilinear);
+	}
+
 private:
-	Vec4f _transCoords(const Vec3f& vec)
+	Vec4f _transCoords(const Vec3f& vec, const Matrix& modelMatrix)
 	{
 		Vec4f homovec{ vec[0], vec[1], vec[2], 1 };
-		homovec = m_proMatrix * m_viewMatrix * m_modeMatrix * homovec; // 转换到裁剪坐标
+		homovec = m_proMatrix * m_viewMatrix * modelMatrix * homovec; // 转换到裁剪坐标
 
 		return homovec;
 	}
@@ -143,7 +232,9 @@ void rasterization(IModel* pIModel, TGAImage& image)
 
 	loadTex(&shader);
 	pEngine->setShader(&shader);
-	drawFaceTriangle(pIModel, pEngine);
+	pEngine->setExecuteType(ExecutexType::Asynchronous); // Asynchronous Synchronous
+	drawFaceIndexed(pIModel, pEngine, shader);
+	pEngine->flush();
 
 	releaseEngine(pEngine);
 }
@@ -194,7 +285,7 @@ void rayTracing(IModel* pIModel, TGAImage& image)
 	material.isEmissive = true;
 	pEngine->addObj(objLight);
 
-	pEngine->buildBVH(10);
+	pEngine->buildBVH(10, 4);
 
 	constexpr const char* diffusePath = "E:/yt/data/数据/african_head_diffuse.tga";
 
@@ -1,5 +1,5 @@
 ﻿#include "common.h"
-#include <random>
+#include <array>
 
 namespace RenderEngine
 {
@@ -130,20 +130,28 @@ namespace RenderEngine
 		return I * eta- N * (eta * cosI + sqrt(k));
 	}
 
-	float randf()
+	float srgbToLinear(unsigned char value)
 	{
-		static std::mt19937 gen(std::random_device{}());
-		static std::uniform_real_distribution<float> dis(0.0f, 1.0f);
-		return dis(gen);
+		static const std::array<float, 256> table = []
+			{
+				std::array<float, 256> result;
+				for (int i = 0; i < 256; ++i)
+				{
+					float x = i / 255.f;
+					result[i] = x <= 0.04045f ? x / 12.92f : std::pow((x + 0.055f) / 1.055f, 2.4f);
+				}
+				return result;
+			}();
+		return table[value];
 	}
 
-	Vec3f randomDirection(const Vec3f& normal)
+	Vec3f randomDirection(const Vec3f& normal, const Vec2f& sample)
 	{
-		Vec3f random;
-		do
-		{
-			random = Vec3f(randf() * 2.0f - 1.0f, randf() * 2.0f - 1.0f, randf() * 2.0f - 1.0f);
-		} while (dot(random, random) >= 1.0f);
+		// 二维采样值映射到单位球面上的均匀分布，每个方向固定占用两个维度，不使用拒绝采样
+		float z = 1.0f - 2.0f * sample.x;
+		float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+		float phi = 2.0f * PI * sample.y;
+		Vec3f random(r * std::cos(phi), r * std::sin(phi), z);
 
 		// 判断是否在法线的同一侧
 		if (dot(random, normal) < 0.0f)
@@ -151,22 +159,4 @@ namespace RenderEngine
 
 		return random * -1;
 	}
-
-	Vec3f (min)(const Vec3f& left, const Vec3f& right)
-	{
-		return Vec3f(
-			std::min(left.x, right.x),
-			std::min(left.y, right.y),
-			std::min(left.z, right.z)
-		);
-	}
-
-	Vec3f (max)(const Vec3f& left, const Vec3f& right)
-	{
-		return Vec3f(
-			std::max(left.x, right.x),
-			std::max(left.y, right.y),
-			std::max(left.z, right.z)
-		);
-	}
 }
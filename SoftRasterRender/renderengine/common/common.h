@@ -2,6 +2,7 @@
 #define __COMMON_H__
 
 #include "geometry.h"
+#include "tgaimage.h"
 #include <algorithm>
 #include <cmath>
 #include <tuple>
@@ -80,23 +81,49 @@ namespace RenderEngine
    */
 	Vec3f refract(const Vec3f& I, const Vec3f& N, float rate);
 
-	/* 生成一个0-1.f的随机数
-   * 返回随机数
+	/* sRGB编码的8位分量解码为[0, 1]范围的线性值，查表得到
+	* value表示sRGB编码的分量
+   * 返回线性值
    */
-	float randf();
+	float srgbToLinear(unsigned char value);
 
-	/* 返回法线半球随机方向
+	/* 8位颜色转为[0, 1]范围的线性RGB，纹理与材质的颜色按sRGB存放，解码后才能参与光照计算
+	* color表示按BGRA存放的颜色
+   * 返回RGB
+   */
+	inline Vec3f colorToRGB(const TGAColor& color)
+	{
+		return Vec3f(srgbToLinear(color.m_bgra[2]), srgbToLinear(color.m_bgra[1]), srgbToLinear(color.m_bgra[0]));
+	}
+
+	/* 返回法线背面半球内均匀分布的单位方向
 	* normal表示法线的方向
+	* sample表示[0, 1)内的二维采样值，由采样器给出
    * 返回随机方向
    */
-	Vec3f randomDirection(const Vec3f& normal);
+	Vec3f randomDirection(const Vec3f& normal, const Vec2f& sample);
 
-	/* 返回各分量最小的值、最大的值
+	/* 返回各分量最小的值、最大的值，构建与遍历BVH时频繁调用，定义在头文件中以便内联
    * left：比较的向量之一
    * right：比较的向量之一
    */
-	Vec3f (min)(const Vec3f& left, const Vec3f& right);
-	Vec3f (max)(const Vec3f& left, const Vec3f& right);
+	inline Vec3f (min)(const Vec3f& left, const Vec3f& right)
+	{
+		return Vec3f(
+			(std::min)(left.x, right.x),
+			(std::min)(left.y, right.y),
+			(std::min)(left.z, right.z)
+		);
+	}
+
+	inline Vec3f (max)(const Vec3f& left, const Vec3f& right)
+	{
+		return Vec3f(
+			(std::max)(left.x, right.x),
+			(std::max)(left.y, right.y),
+			(std::max)(left.z, right.z)
+		);
+	}
 }
 #endif // !__COMMON_H__
 
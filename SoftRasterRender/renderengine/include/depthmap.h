@@ -0,0 +1,71 @@
+﻿#ifndef __DEPTHMAP_H__
+#define __DEPTHMAP_H__
+
+#include <vector>
+#include "rasterpipeline.h"
+
+// 独立的深度图，用作只写深度的绘制目标，例如从光源视角生成阴影图
+// 尺寸由使用者决定，与目标设备无关，绘制时的视口变换取着色器的m_viewportMatrix
+class DepthMap
+{
+public:
+    DepthMap() = default;
+    DepthMap(int width, int height) { resize(width, height); }
+
+    void resize(int width, int height)
+    {
+        m_width = width;
+        m_height = height;
+        // 行按层次深度块对齐，最后一行之后再留一个块宽，按向量读写时不会越界
+        m_stride = (width + RasterPipeline::hizBlockSize - 1) / RasterPipeline::hizBlockSize * RasterPipeline::hizBlockSize;
+        m_depth.resize((size_t)m_stride * height + RasterPipeline::hizBlockSize);
+        m_hizCols = m_stride / RasterPipeline::hizBlockSize;
+        int hizRows = (height + RasterPipeline::hizBlockSize - 1) / RasterPipeline::hizBlockSize;
+        m_hizMin.resize((size_t)m_hizCols * hizRows);
+        m_hizMax.resize((size_t)m_hizCols * hizRows);
+        clear();
+    }
+
+    void clear(float depth = 1.f)
+    {
+        std::fill(m_depth.begin(), m_depth.end(), depth);
+        std::fill(m_hizMin.begin(), m_hizMin.end(), depth);
+        std::fill(m_hizMax.begin(), m_hizMax.end(), depth);
+    }
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+
+    // 读取深度，超出范围时返回最远的深度
+    float depth(int x, int y) const
+    {
+        if (x < 0 || x >= m_width || y < 0 || y >= m_height)
+            return 1.f;
+
+        return m_depth[(size_t)y * m_stride + x];
+    }
+
+    RasterPipeline::RasterTarget rasterTarget()
+    {
+        RasterPipeline::RasterTarget target;
+        target.pZBuffer = m_depth.data();
+        target.width = m_width;
+        target.height = m_height;
+        target.stride = m_stride;
+        target.pHiZMin = m_hizMin.data();
+        target.pHiZMax = m_hizMax.data();
+        target.hizCols = m_hizCols;
+        return target;
+    }
+
+private:
+    int m_width = 0;
+    int m_height = 0;
+    int m_stride = 0;
+    int m_hizCols = 0;
+    std::vector<float> m_depth;
+    std::vector<float> m_hizMin;
+    std::vector<float> m_hizMax;
+};
+
+#endif // !__DEPTHMAP_H__
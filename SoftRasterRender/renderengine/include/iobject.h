@@ -69,6 +69,10 @@ interface IObject
 
 	// 获取交点
     virtual HitResult intersect(const Ray& ray) PURE;
+
+    // 由交点的距离与重心坐标补全求交结果（交点、法线、纹理坐标与材质），u、v为第二、三个顶点的权重
+    // 加速结构遍历时只记录距离、重心坐标与图元编号，遍历结束后只对最近的交点调用一次
+    virtual HitResult getHitResult(const Ray& ray, float distance, float u, float v) PURE;
 };
 
 #endif // !__IOBJECT_H__
@@ -2,6 +2,8 @@
 #define __IRENDERENGINE_H__
 
 #include "ishader.h"
+#include "rasterpipeline.h"
+#include "depthmap.h"
 
 #ifndef IMPORT_IMODEL
 #define RENDER_MODULE __declspec(dllexport)
@@ -24,6 +26,14 @@ enum class ExecutexType : int8_t
     Asynchronous
 };
 
+// 光线追踪的采样方式，采样值只由像素、采样序号与维度决定，渲染结果与线程数无关
+enum class SamplerType : int8_t
+{
+    Random = 0, // 每个采样独立播种的PCG随机数
+    Stratified, // 分层抖动，二维上使用相关多重抖动，每setSampleCount个采样为一组完整的分层，之后的采样是新的一组
+    Sobol       // Owen扰乱的Sobol序列，相同采样数下噪声最低
+};
+
 interface IRenderEngin
 {
 	virtual ~IRenderEngin() = default;
@@ -47,15 +57,102 @@ interface IRasterRenderEngin : public IRenderEngin
 	// 设置着色器
     virtual void setShader(IShader* pIShader) PURE;
 
-    // 绘制直线
+    // 设置渲染目标的颜色格式（默认RGBA8），下次设置目标设备时生效
+    virtual void setColorFormat(const RasterPipeline::ColorFormat format) PURE;
+
+    // 设置着色的方式（默认Forward），下次设置目标设备时生效
+    // Deferred：绘制时只执行几何着色写入G-buffer，flush时对每个可见像素执行一次光照着色，与深度复杂度无关
+    // 光照着色使用绘制该像素的着色器，并行模式下各分块在线程池中并行执行
+    virtual void setShadingMode(const RasterPipeline::ShadingMode mode) PURE;
+
+    // 设置光栅化的执行方式
+    // Synchronous：每个三角形立即在当前线程光栅化
+    // Asynchronous：三角形先分配到屏幕分块中，调用flush时各分块在线程池中并行光栅化
+    // 并行模式下片段着色器会被多个线程同时调用，需要保证其线程安全
+    virtual void setExecuteType(const ExecutexType type) PURE;
+
+    // 设置深度测试的方式，默认为Less
+    // 先用drawDepth做深度预渲染，再设置为Equal绘制，每个可见像素只执行一次片段着色器
+    virtual void setDepthTest(const RasterPipeline::DepthTest depthTest) PURE;
+
+    // 光栅化所有缓存的三角形，并把渲染目标写入目标设备，一帧绘制结束时必须调用
+    virtual void flush() PURE;
+
+    // 上一次flush完成的一帧的流水线统计与各阶段耗时，一帧从上一次flush（或设置目标设备）开始
+    // 计数只在分块内累计、每帧汇总一次，耗时按绘制或分块批次计时，可以一直开启
+    virtual RasterPipeline::PipelineStats getPipelineStats() const PURE;
+
+    // 开启可见性缓冲，记录每个像素上最终可见的图元，下次设置目标设备时生效
+    // 配合drawDepth只写深度与图元编号，之后只对可见像素着色
+    virtual void setVisibilityBuffer(bool bEnable) PURE;
+
+    // 设置之后绘制的编号，写入可见性缓冲
+    // 实例化绘制中三角形的序号为 实例序号 * 每个实例的三角形数 + 三角形在实例中的序号
+    virtual void setDrawID(uint32_t drawID) PURE;
+
+    // 读取可见性缓冲，没有开启时pSamples为空，并行模式下会先光栅化缓存的三角形
+    virtual RasterPipeline::VisibilityBuffer getVisibilityBuffer() PURE;
+
+    // 遮挡查询，统计beginQuery与endQuery之间的绘制中通过深度测试且没有被片段着色器丢弃的像素个数
+    // query是使用者指定的非负编号，可以重复使用，同一时间只有一个查询处于活动状态
+    virtual void beginQuery(int query) PURE;
+    virtual void endQuery() PURE;
+
+    // 读取查询结果，并行模式下会先光栅化缓存的三角形
+    virtual int64_t getQueryResult(int query) PURE;
+
+    // 绘制直线，与其他绘制一样写入渲染目标，调用flush后才会出现在目标设备上
     virtual void drawLine(Vec2i start, Vec2i end, TGAColor color) PURE;
     virtual void drawLine(int x0, int y0, int x1, int y1, TGAColor color) PURE;
 
-    // 扫线算法填充三角形
+    // 批量绘制三角形列表的线框，每三个索引组成一个三角形，count为索引个数
+    // 相邻三角形共享的边只绘制一次，顶点经过当前着色器的顶点着色器与视口变换，线段只在视口内裁剪一次
+    // 调用返回时已经绘制完成，并行模式下按屏幕横条在线程池中并行光栅化
+    // bDepthTest为true时与深度缓冲比较（不写深度），先绘制实体再绘制线框得到消隐线框
+    // 延迟着色时光照阶段会覆盖几何上的线框，需要在其之后绘制的线框应使用前向着色
+    virtual void drawWireframe(const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count, TGAColor color, bool bDepthTest = false) PURE;
+
+    // 扫线算法填充三角形，写入渲染目标，调用flush后才会出现在目标设备上
     virtual void drawTriangle(Vec3f v0, Vec3f v1, Vec3f v2, TGAColor color) PURE;
 
     // 重心算法填充三角形
     virtual void drawTriangle(const IShader::VertexInput& input) PURE;
+
+    // 索引绘制三角形列表，每三个索引组成一个三角形，count为索引个数
+    // 每个顶点只执行一次顶点着色器，结果被共享该顶点的三角形复用
+    // 索引必须在[0, vertexStreams.count)内，有越界的索引时整个绘制不执行（线框与实例化绘制相同）
+    virtual void drawIndexed(const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count) PURE;
+
+    // 只写深度的索引绘制，只使用顶点着色器输出的位置，不插值属性也不执行片段着色器
+    // pDepthMap为空时写入当前渲染目标的深度（深度预渲染），遵循执行方式
+    // 否则写入指定的深度图（例如阴影图），在当前线程立即完成，视口变换取着色器的m_viewportMatrix
+    virtual void drawDepth(const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count, DepthMap* pDepthMap = nullptr) PURE;
+
+    // 实例化的索引绘制，同一份顶点数据按每个实例的属性绘制instanceCount次
+    // 每个实例都重新执行顶点着色器，着色器从VertexStreams::pInstance读取实例属性
+    // 并行模式下所有实例的三角形进入同一批分块，flush时一起光栅化，pInstances要保持有效直到绘制返回
+    virtual void drawIndexedInstanced(const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count, const IShader::InstanceData* pInstances, int instanceCount) PURE;
+
+    // 实例化的只写深度绘制，参数同drawDepth
+    virtual void drawDepthInstanced(const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count, const IShader::InstanceData* pInstances, int instanceCount, DepthMap* pDepthMap = nullptr) PURE;
+
+    // 使用指定的着色器及其实例化的各阶段进行索引绘制
+    virtual void drawIndexed(const RasterPipeline::DrawKernel& kernel, const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count) PURE;
+    virtual void drawIndexedInstanced(const RasterPipeline::DrawKernel& kernel, const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count, const IShader::InstanceData* pInstances, int instanceCount) PURE;
+
+    // 着色器类型在编译期确定的索引绘制，顶点、片段着色器可以内联到光栅化循环中
+    // 只对这次绘制使用传入的着色器，不影响setShader设置的着色器，并行模式下着色器要保持有效直到flush
+    template<class ShaderT, std::enable_if_t<std::is_base_of_v<IShader, ShaderT>, int> = 0>
+    void drawIndexed(ShaderT& shader, const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count)
+    {
+        drawIndexed(RasterPipeline::makeDrawKernel(shader), vertexStreams, indexBuffer, count);
+    }
+
+    template<class ShaderT, std::enable_if_t<std::is_base_of_v<IShader, ShaderT>, int> = 0>
+    void drawIndexedInstanced(ShaderT& shader, const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count, const IShader::InstanceData* pInstances, int instanceCount)
+    {
+        drawIndexedInstanced(RasterPipeline::makeDrawKernel(shader), vertexStreams, indexBuffer, count, pInstances, instanceCount);
+    }
 };
 
 // 光线追踪渲染引擎
@@ -70,16 +167,43 @@ interface IRayTraceRenderEngin : public IRenderEngin
     virtual void setModeMatrix(const Matrix& mode) PURE;
 
 	// 构建BVH加速结构（默认采用SAH构建），指定叶子节点存储的三角形个数
-	virtual void buildBVH(int count) PURE;
+	// width为节点的孩子数，可以是2、4、8，4、8时二叉树构建完成后合并为宽节点，一次SIMD测试所有孩子的包围盒
+	virtual void buildBVH(int count, int width = 2) PURE;
 
-    // 设置采样次数
+    // 设置采样次数，开启自适应采样或时间预算时为每个像素采样数的上限
     virtual void setSampleCount(int count) PURE;
 
+    // 自适应采样，targetError大于0时开启（默认关闭），为像素亮度均值的相对标准误差，例如0.02
+    // 每个像素至少渲染minSamples个采样，之后误差不超过targetError的像素不再采样
+    virtual void setAdaptiveSampling(int minSamples, float targetError) PURE;
+
+    // rayGeneration的时间预算（秒），到时后不再领取新的分块，已经累积的采样照常解析，0表示不限制（默认）
+    // 最后一轮没有领取到的分块（按Morton顺序靠后）比其他分块少一轮的采样
+    virtual void setTimeBudget(float seconds) PURE;
+
+    // 设置采样方式，默认为Sobol
+    virtual void setSamplerType(const SamplerType type) PURE;
+
     // 设置光线追踪的最大深度
     virtual void setMaxDepth(int depth) PURE;
 
-    // 开始渲染
+    // 开始渲染，清空累积缓冲后每个像素渲染setSampleCount个采样，再解析到目标设备
+    // 开启自适应采样或时间预算时分轮渲染，每轮为未收敛的像素各渲染minSamples个采样
+    // 直到所有像素收敛、达到采样数上限或者用完时间预算
     virtual void rayGeneration(const ExecutexType type = ExecutexType::Synchronous) PURE;
+
+    // 渐进式渲染，采样以线性的HDR颜色累积在浮点缓冲中，目标设备只在resolve时写入
+    // clearAccumulation清空累积缓冲，之后每次renderPass为每个像素再累积samples个采样，返回像素中最多的采样数
+    // 开启自适应采样时跳过已经收敛的像素，各像素的采样数可能不同，返回值只计实际完成的采样
+    // 任意一次renderPass之后都可以resolve得到当前的图像，可以按时间预算提前停止
+    virtual void clearAccumulation() PURE;
+    virtual int renderPass(int samples, const ExecutexType type = ExecutexType::Synchronous) PURE;
+
+    // 累积的平均值乘以曝光，经过色调映射（ACES）与sRGB编码写入目标设备
+    virtual void resolve() PURE;
+
+    // 设置色调映射前的曝光，默认为1
+    virtual void setExposure(float exposure) PURE;
 };
 
 extern "C"
@@ -7,6 +7,7 @@
 #include <tuple>
 #include "geometry.h"
 #include "tgaimage.h"
+#include "texture.h"
 
 #define interface struct
 #define PURE =0
@@ -17,15 +18,22 @@ enum class TextureType : int8_t
 	Norm,
 	Specular,
 	// 还有就往后面加
+	Count // 纹理种类个数，放在最后
 };
 
 // 用户需要自定义着色器，通过setShader接口设置着色器
-// 在调用drawTriangle的时候传入VertexInput即可
+// 在调用drawTriangle的时候传入VertexInput，或者调用drawIndexed传入VertexStreams
+// 实例化绘制时顶点着色器通过VertexStreams::pInstance取得当前实例的属性
+// 顶点着色器把需要插值的属性写成若干个float分量（varyings），分量个数由varyingCount声明
+// 光栅化时这些分量统一做透视校正插值后交给片段着色器
 interface IShader
 {
-    using TextureContainer = std::unordered_map<TextureType, std::unique_ptr<TGAImage>>;
+    using TextureContainer = std::unordered_map<TextureType, std::unique_ptr<Texture>>;
 
-    // 顶点着色器输入都是一组顶点数据，三角形的三个顶点
+    // 插值属性的最大分量个数
+    static constexpr int MaxVaryings = 16;
+
+    // 一组三角形顶点数据，drawTriangle使用
     struct VertexInput
     {
         std::optional<std::array<Vec3f, 3>> pVert; // 三角形顶点位置属性, 必须设置
@@ -35,58 +43,132 @@ interface IShader
         // 先包括这几个常用的吧
     };
 
+    // 实例化绘制时每个实例的属性，所有实例共享同一份顶点数据
+    struct InstanceData
+    {
+        Matrix modelMatrix; // 实例的模型矩阵，代替m_modeMatrix
+        TGAColor color; // 实例的颜色，选择性使用
+        int materialIndex = 0; // 实例的材质索引，选择性使用
+    };
+
+    // 顶点着色器的输入，各属性数组通过同一个顶点索引访问
+    struct VertexStreams
+    {
+        const Vec3f* pVert = nullptr; // 顶点位置属性, 必须设置
+        const Vec2f* pUV = nullptr; // 顶点纹理属性，选择性设置
+        const Vec3f* pNorm = nullptr; // 顶点法线属性，选择性设置
+        const Vec3f* pTangent = nullptr; // 顶点切线，选择性设置，需要与副切线一起设置
+        const Vec3f* pBitangent = nullptr; // 顶点副切线
+        int count = 0; // 顶点数量
+
+        // 当前绘制的实例，由引擎在实例化绘制时设置，非实例化绘制时为空
+        const InstanceData* pInstance = nullptr;
+        int instanceID = 0;
+    };
+
+    // 单个顶点经过顶点着色器后的输出，索引绘制时缓存起来供共享该顶点的三角形使用
     struct VertexOutput
     {
-        std::optional<std::array<Vec4f, 3>> pPos; // 裁剪空间位置
-        std::optional<std::array<Vec2f, 3>> pTexCoord; // 纹理属性（不需要转换）
-        std::optional<std::array<Vec3f, 3>> pNorm; // 转换后的法线坐标
-        std::optional<std::tuple<Vec3f, Vec3f>> pTangent;
+        Vec4f pos; // 裁剪空间位置
+        float varyings[MaxVaryings]; // 需要插值的属性，只有前varyingCount()个分量有效
     };
 
-    // 片段着色器输入都是单个片段（元素的数据）
+    // 片段着色器的输入，插值后的属性按分量分开存放（SoA）
+    // 同一个分量上相邻像素连续存放，因此同一像素的相邻分量之间间隔stride个float
     struct FragmentInput
     {
-        std::optional<Vec3f> pPixelVert; // 片段插值后的位置属性
-        std::optional<Vec2f> pPixeUV; // 片段插值后纹理属性
-        std::optional<Vec3f> pPixeNorm; // 片段插值后法线属性
-        std::optional<std::tuple<Vec3f, Vec3f>> pPixelTangent;
+        Vec3f fragCoord; // 片段的屏幕坐标及深度
+        const float* pVaryings = nullptr; // 该像素第0个分量的地址
+        int stride = 1;
+
+        // 分量在所在2x2像素块内沿屏幕x、y方向的差分，只有useDerivatives返回true时才有效
+        const float* pDdx = nullptr;
+        const float* pDdy = nullptr;
+
+        float varying(int index) const { return pVaryings[index * stride]; }
+        Vec2f varying2(int index) const { return Vec2f(varying(index), varying(index + 1)); }
+        Vec3f varying3(int index) const { return Vec3f(varying(index), varying(index + 1), varying(index + 2)); }
+
+        Vec2f ddx2(int index) const { return Vec2f(pDdx[index * stride], pDdx[(index + 1) * stride]); }
+        Vec2f ddy2(int index) const { return Vec2f(pDdy[index * stride], pDdy[(index + 1) * stride]); }
+    };
+
+    // 延迟着色时G-buffer中每个像素的表面属性，深度仍在深度缓冲中
+    struct SurfaceData
+    {
+        static constexpr uint32_t noSurface = 0xffffffff;
+
+        Vec3f normal;
+        Vec2f uv;
+        float lod = 0.f; // 纹理采样的mip层级，几何阶段由差分算好，光照阶段没有差分可用
+        uint32_t materialID = 0;
+        uint32_t lightingIndex = noSurface; // 引擎使用，记录由哪个着色器做光照，没有表面的像素为noSurface
     };
 
     virtual ~IShader() {};
 
-    // 顶点着色器的主要功能是坐标转换，一般强制输出位置坐标（位于裁剪坐标系）
-    // 输入一组三角形的顶点属性，输出经过坐标转换后的一组顶点属性
-    virtual VertexOutput vertex(VertexInput vertexInput) PURE;
+    // 声明顶点着色器输出的插值分量个数，不能超过MaxVaryings
+    virtual int varyingCount() const { return 0; }
+
+    // 片段着色器是否需要分量的屏幕空间差分（例如计算纹理的mip层级），需要时光栅化会额外计算
+    virtual bool useDerivatives() const { return false; }
+
+    // 顶点着色器的主要功能是坐标转换，每个顶点执行一次
+    // 输入顶点流与顶点索引，返回裁剪坐标系下的位置，需要插值的属性写到varyings中
+    virtual Vec4f vertex(const VertexStreams& streams, int index, float* varyings) PURE;
 
     // 片段着色器的主要功能是计算颜色
     // 输入经过插值过后的片段属性，输出最后的颜色值
     // 返回值表示是否丢弃该片段，true表示丢弃该片段
-    virtual bool fragment(FragmentInput fragAttrs, TGAColor& outColor) PURE;
+    virtual bool fragment(const FragmentInput& fragInput, TGAColor& outColor) PURE;
+
+    // 延迟着色的几何阶段，代替片段着色器，只输出表面属性，不做纹理采样与光照
+    // 返回值表示是否丢弃该片段，没有实现的着色器在延迟着色模式下不产生任何像素
+    virtual bool geometry(const FragmentInput& /*fragInput*/, SurfaceData& /*outSurface*/) { return true; }
+
+    // 延迟着色的光照阶段，每帧对每个可见像素只执行一次，fragCoord为像素的屏幕坐标及深度
+    virtual void lighting(const Vec3f& /*fragCoord*/, const SurfaceData& /*surface*/, TGAColor& /*outColor*/) {}
 
     virtual void setTexture(TGAImage* img, TextureType type)
     {
-        TGAImage* data = new TGAImage(*img);
+        Texture* data = new Texture(*img); // 构建时生成mip链
         m_texs.insert(std::make_pair(type, data));
     }
 
     virtual void setTexture(TGAImage&& img, TextureType type)
     {
-        // 右值引用本身是个左值，需要再次转为右值（函数返回右值引用属于将亡值）
-        TGAImage* data = new TGAImage(std::move(img));
+        // 纹素会重新排列到纹理自己的存储中，原图用完即可释放
+        Texture* data = new Texture(img);
         m_texs.insert(std::make_pair(type, data));
     }
 
     virtual TGAColor getTexture(const Vec2f uv, TextureType type)
     {
-        // 获取纹理
+        // 获取纹理，直接查找纹理表，绘制之外调用或绘制之间换过纹理都能取到当前的纹理
         TGAColor color;
         auto itemTex = m_texs.find(type);
         if (itemTex != m_texs.end())
-            color = itemTex->second->diffuse(uv);
+            color = itemTex->second->sample(uv);
 
         return color;
     }
 
+    // 把纹理解析成按类型索引的直接指针，引擎在每次绘制开始时调用
+    // 着色器在绘制中采样时通过textureSlot取用，不再逐像素查找哈希表
+    void resolveTextures()
+    {
+        for (int i = 0; i < (int)TextureType::Count; ++i)
+        {
+            auto itemTex = m_texs.find((TextureType)i);
+            m_texSlots[i] = itemTex != m_texs.end() ? itemTex->second.get() : nullptr;
+        }
+    }
+
+    const Texture* textureSlot(TextureType type) const
+    {
+        return m_texSlots[(int)type];
+    }
+
     // 视图转换相关，默认为单位矩阵
     Matrix m_modeMatrix; // 世界坐标
     Matrix m_viewMatrix; // 相机（视角）坐标
@@ -96,6 +178,7 @@ interface IShader
 private:
     // 存储纹理
     TextureContainer m_texs;
+    const Texture* m_texSlots[(int)TextureType::Count] = {}; // 当前绘制解析出的纹理指针
 };
 
 #endif // !__ISHADER_H__
\ No newline at end of file
@@ -0,0 +1,814 @@
+﻿#ifndef __RASTERPIPELINE_H__
+#define __RASTERPIPELINE_H__
+
+#include <type_traits>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+#include <atomic>
+#include <bitset>
+#include "ishader.h"
+#include "simd.h"
+
+// 光栅化流水线中与着色器类型相关的部分
+// 顶点着色与逐像素的光栅化循环都是模板，按着色器类型实例化
+// 具体的着色器类型（建议声明为final）实例化时，顶点、片段着色器的调用是静态绑定的，可以内联到光栅化循环中
+// 以IShader实例化时就是普通的虚函数调用
+namespace RasterPipeline
+{
+    // 屏幕上的矩形区域，闭区间
+    struct ScreenRect
+    {
+        int minX = 0;
+        int minY = 0;
+        int maxX = -1;
+        int maxY = -1;
+    };
+
+    // 边函数 E(x, y) = A * x + B * y + C，在三角形内侧为正
+    struct EdgeFunction
+    {
+        float A = 0.f;
+        float B = 0.f;
+        float C = 0.f;
+    };
+
+    // 顶点坐标的亚像素精度，视口坐标对齐到1 / subpixelScale像素
+    constexpr int subpixelBits = 8;
+    constexpr int subpixelScale = 1 << subpixelBits;
+
+    // 定点边函数，坐标以亚像素为单位，像素(x, y)的采样点为(x * subpixelScale, y * subpixelScale)
+    // C中已经包含填充规则的偏移，E >= 0的采样点在三角形内
+    struct FixedEdge
+    {
+        int64_t A = 0;
+        int64_t B = 0;
+        int64_t C = 0;
+    };
+
+    // 定点边函数在一个块内的形式，块内偏移(dx, dy)处 E = E0 + subpixelScale * (A * dx + B * dy)，E0为块起点处的值
+    // 覆盖测试只看符号，等价于 A * dx + B * dy >= threshold，都在int32范围内
+    struct BlockEdge
+    {
+        int A = 0;
+        int B = 0;
+        int threshold = 0;
+        float base = 0.f; // 块起点处的边函数值（像素单位），用于计算重心权重
+
+        // 块内矩形上的最大值能否达到阈值，不能时整个矩形在边的外侧
+        bool reaches(int dx0, int dy0, int dx1, int dy1) const
+        {
+            return std::max(A * dx0, A * dx1) + std::max(B * dy0, B * dy1) >= threshold;
+        }
+    };
+
+    // 屏幕空间线性变化的量，value = base + b1 * d1 + b2 * d2，b1、b2为顶点1、2的重心权重
+    struct AttrPlane
+    {
+        float base = 0.f;
+        float d1 = 0.f;
+        float d2 = 0.f;
+    };
+
+    // 层次深度缓冲的块边长（像素），光栅化按块遍历
+    constexpr int hizBlockSize = 8;
+
+    // 渲染目标的颜色格式
+    enum class ColorFormat : int8_t
+    {
+        RGBA8 = 0,
+        RGBA32F
+    };
+
+    // 着色的方式
+    enum class ShadingMode : int8_t
+    {
+        Forward = 0, // 通过深度测试的片段立即执行片段着色器
+        Deferred // 几何阶段只写G-buffer，flush时对每个可见像素执行一次光照
+    };
+
+    // 可见性缓冲中每个像素记录的图元，延迟到之后只对可见像素着色
+    struct VisibilitySample
+    {
+        static constexpr uint32_t invalidID = 0xffffffff; // 没有图元覆盖
+
+        uint32_t drawID = invalidID; // 绘制时通过setDrawID设置的编号
+        uint32_t primitiveID = invalidID; // 三角形在这次绘制中的序号
+    };
+
+    // 可见性缓冲的只读视图，行按stride个像素存放
+    struct VisibilityBuffer
+    {
+        const VisibilitySample* pSamples = nullptr; // 没有开启可见性缓冲时为空
+        int width = 0;
+        int height = 0;
+        int stride = 0;
+
+        const VisibilitySample& at(int x, int y) const { return pSamples[(size_t)y * stride + x]; }
+    };
+
+    // 光栅化写入的目标，各平面的行都按stride个像素存放
+    struct RasterTarget
+    {
+        uint32_t* pColor8 = nullptr; // RGBA8格式的颜色，字节顺序与TGAColor一致
+        float* pColorF = nullptr; // RGBA32F格式的颜色，两者只有一个有效
+        float* pZBuffer = nullptr; // 最后一行之后至少留有一个向量宽度
+        int width = 0;
+        int height = 0;
+        int stride = 0;
+
+        // 层次深度缓冲，每个块记录其中深度的最小、最大值，随深度写入更新
+        float* pHiZMin = nullptr;
+        float* pHiZMax = nullptr;
+        int hizCols = 0;
+
+        uint8_t* pOverdraw = nullptr; // 每个像素通过深度测试的次数，饱和到255，用于统计
+        VisibilitySample* pVisibility = nullptr; // 可见性缓冲，选择性开启
+        IShader::SurfaceData* pSurface = nullptr; // G-buffer，延迟着色时才有
+    };
+
+    // 深度测试的方式
+    enum class DepthTest : int8_t
+    {
+        Less = 0, // 比已有深度近时通过，并写入深度
+        Equal // 与已有深度相等时通过，不写深度，配合深度预渲染使每个可见像素只着色一次
+    };
+
+    // 光栅化阶段的统计，并行模式下在每个分块内累计再汇总，三角形按落在每个分块中的部分计数
+    struct RasterStats
+    {
+        int64_t hizCulledBlocks = 0; // 被层次深度剔除的块
+        int64_t fragmentsTested = 0; // 被三角形覆盖、参与深度测试的像素
+        int64_t fragmentsPassed = 0; // 通过深度测试的像素
+        int64_t fragmentsShaded = 0; // 执行了片段着色器（延迟着色时为几何着色）的像素
+        int64_t fragmentsDiscarded = 0; // 被着色器丢弃的像素
+
+        RasterStats& operator+=(const RasterStats& other)
+        {
+            hizCulledBlocks += other.hizCulledBlocks;
+            fragmentsTested += other.fragmentsTested;
+            fragmentsPassed += other.fragmentsPassed;
+            fragmentsShaded += other.fragmentsShaded;
+            fragmentsDiscarded += other.fragmentsDiscarded;
+            return *this;
+        }
+    };
+
+    // 一帧的流水线统计与各阶段耗时，类似GPU的管线统计查询
+    struct PipelineStats
+    {
+        static constexpr int overdrawBins = 8;
+
+        // 几何阶段，三角形都按图元计数：没有裁剪时inputTriangles = culledFrustum + culledBackface + culledOffscreen + rasterTriangles
+        // culledHiZ是rasterTriangles中被整个剔除的部分
+        int64_t vertexInvocations = 0; // 顶点着色器执行次数，缓存命中的顶点不计
+        int64_t inputTriangles = 0; // 绘制提交的三角形
+        int64_t culledFrustum = 0; // 三个顶点都在视锥同一个平面外
+        int64_t culledBackface = 0; // 背面或面积为0
+        int64_t culledOffscreen = 0; // 包围盒与渲染目标不相交
+        int64_t culledHiZ = 0; // 覆盖到的块都被层次深度剔除，并行模式下合并所有分块的结果后计数
+        int64_t clippedTriangles = 0; // 经过齐次空间裁剪的三角形
+        int64_t rasterTriangles = 0; // 进入光栅化的三角形，裁剪出的三角形分别计数
+
+        // 光栅化与着色阶段
+        RasterStats raster;
+        int64_t lightingInvocations = 0; // 延迟着色光照阶段着色的像素
+        int64_t overdraw[overdrawBins] = {}; // 通过深度测试i次的像素个数，最后一项为不少于overdrawBins - 1次
+
+        // 各阶段耗时（毫秒），并行执行的阶段为墙上时间
+        double vertexTime = 0.0; // 顶点着色
+        double primitiveTime = 0.0; // 图元装配、裁剪、三角形建立与分块，立即光栅化时计入rasterTime
+        double rasterTime = 0.0; // 光栅化与片段着色
+        double lightingTime = 0.0; // 延迟着色的光照阶段
+        double resolveTime = 0.0; // 渲染目标写入设备
+    };
+
+    // 光栅化一个三角形的结果，并行模式下同一个三角形在各分块的结果按位或合并
+    // 只有CoverageBlocks没有CoverageVisible时，三角形被层次深度整个剔除
+    enum RasterCoverage : uint8_t
+    {
+        CoverageNone = 0,
+        CoverageBlocks = 1 << 0, // 有块被三角形覆盖
+        CoverageVisible = 1 << 1 // 有块通过了层次深度测试
+    };
+
+    struct RasterTriangle;
+    using VertexFunc = Vec4f(*)(IShader* pIShader, const IShader::VertexStreams& streams, int index, float* varyings);
+    using RasterFunc = uint8_t(*)(const RasterTriangle& triangle, const ScreenRect& clipRect, const RasterTarget& target, RasterStats& stats);
+    using LightingFunc = void(*)(IShader* pIShader, const Vec3f& fragCoord, const IShader::SurfaceData& surface, TGAColor& outColor);
+
+    // 经过顶点着色与视口变换后等待光栅化的三角形
+    struct RasterTriangle
+    {
+        IShader* pIShader = nullptr; // 绘制时绑定的着色器
+        RasterFunc pRasterize = nullptr; // 按着色器类型实例化的光栅化函数
+        ScreenRect bound; // 屏幕包围盒
+        FixedEdge fixedEdges[3]; // fixedEdges[i]为顶点i对面的边，用于覆盖测试
+        EdgeFunction edges[3]; // 同样的边（像素单位），其值与面积之比即顶点i的重心权重
+        float invArea = 0.f; // 三角形面积（两倍）的倒数
+        AttrPlane depth; // 深度
+        float minDepth = 0.f; // 顶点深度的范围
+        float maxDepth = 0.f;
+        DepthTest depthTest = DepthTest::Less;
+        AttrPlane invW; // 1/w，透视校正用
+        int varyingCount = 0;
+        bool useDerivatives = false; // 是否计算分量的屏幕空间差分
+        AttrPlane varyings[IShader::MaxVaryings]; // 各插值分量除以w后的值
+
+        uint32_t lightingIndex = 0; // 延迟着色时写入G-buffer，光照阶段据此找到着色器
+        VisibilitySample id; // 写入可见性缓冲的编号
+        std::atomic<int64_t>* pQuerySamples = nullptr; // 绘制时处于活动状态的遮挡查询，累计通过深度测试的像素个数
+    };
+
+    // 裁剪到视口内的屏幕空间线段，深度在屏幕空间线性插值
+    struct ScreenLine
+    {
+        Vec3f p0;
+        Vec3f p1;
+        int minY = 0; // 经过的行的范围，用于分配到横条
+        int maxY = -1;
+    };
+
+    // 一次绘制用到的着色器及其实例化的各阶段
+    struct DrawKernel
+    {
+        IShader* pIShader = nullptr;
+        VertexFunc pVertex = nullptr;
+        RasterFunc pRasterize = nullptr;
+        RasterFunc pRasterizeGeometry = nullptr; // 延迟着色的几何阶段
+        LightingFunc pLighting = nullptr; // 延迟着色的光照阶段
+        int varyingCount = 0; // 每次绘制只查询一次
+        bool useDerivatives = false;
+        bool depthOnly = false; // 只写深度，不执行片段着色器
+    };
+
+    SIMD_INLINE void writeColor(const RasterTarget& target, int x, int y, const TGAColor& color)
+    {
+        size_t index = (size_t)y * target.stride + x;
+        if (target.pColor8)
+        {
+            std::memcpy(target.pColor8 + index, color.m_bgra, sizeof(uint32_t));
+            return;
+        }
+
+        float* pColor = target.pColorF + index * 4;
+        for (int i = 0; i < 4; ++i)
+        {
+            pColor[i] = color.m_bgra[i] * (1.f / 255.f);
+        }
+    }
+
+    SIMD_INLINE void writeVisibility(const RasterTarget& target, int x, int y, const VisibilitySample& id)
+    {
+        if (target.pVisibility)
+            target.pVisibility[(size_t)y * target.stride + x] = id;
+    }
+
+    SIMD_INLINE int bitCount(int mask)
+    {
+        return (int)std::bitset<32>((uint32_t)mask).count();
+    }
+
+    SIMD_INLINE void countOverdraw(const RasterTarget& target, int x, int y)
+    {
+        if (target.pOverdraw)
+        {
+            uint8_t& count = target.pOverdraw[(size_t)y * target.stride + x];
+            count += count != 0xff;
+        }
+    }
+
+    // 三角形光栅化结束时把通过的像素数一次性累加到遮挡查询，不逐像素做原子操作
+    SIMD_INLINE void addQuerySamples(const RasterTriangle& triangle, int64_t samples)
+    {
+        if (triangle.pQuerySamples && samples)
+            triangle.pQuerySamples->fetch_add(samples, std::memory_order_relaxed);
+    }
+
+    template<class ShaderT>
+    Vec4f shadeVertex(IShader* pIShader, const IShader::VertexStreams& streams, int index, float* varyings)
+    {
+        ShaderT* pShader = static_cast<ShaderT*>(pIShader);
+        if constexpr (std::is_same_v<ShaderT, IShader>)
+            return pShader->vertex(streams, index, varyings);
+        else
+            return pShader->ShaderT::vertex(streams, index, varyings); // 限定名调用，不走虚表
+    }
+
+    template<class ShaderT>
+    SIMD_INLINE bool shadeFragment(ShaderT* pShader, const IShader::FragmentInput& fragInput, TGAColor& outColor)
+    {
+        if constexpr (std::is_same_v<ShaderT, IShader>)
+            return pShader->fragment(fragInput, outColor);
+        else
+            return pShader->ShaderT::fragment(fragInput, outColor);
+    }
+
+    template<class ShaderT>
+    void shadeLighting(IShader* pIShader, const Vec3f& fragCoord, const IShader::SurfaceData& surface, TGAColor& outColor)
+    {
+        ShaderT* pShader = static_cast<ShaderT*>(pIShader);
+        if constexpr (std::is_same_v<ShaderT, IShader>)
+            pShader->lighting(fragCoord, surface, outColor);
+        else
+            pShader->ShaderT::lighting(fragCoord, surface, outColor);
+    }
+
+    template<class ShaderT>
+    SIMD_INLINE bool shadeGeometry(ShaderT* pShader, const IShader::FragmentInput& fragInput, IShader::SurfaceData& outSurface)
+    {
+        if constexpr (std::is_same_v<ShaderT, IShader>)
+            return pShader->geometry(fragInput, outSurface);
+        else
+            return pShader->ShaderT::geometry(fragInput, outSurface);
+    }
+
+    // 块内深度范围放宽一点，避免与逐像素插值的舍入误差不一致
+    constexpr float hizDepthEpsilon = 1e-5f;
+
+    // 插值屏幕空间线性变化的量，深度预渲染与着色的两次绘制必须用同样的算式，相等测试才能成立
+    SIMD_INLINE vfloat interpolatePlane(const AttrPlane& plane, const vfloat& b1, const vfloat& b2)
+    {
+        return vfloat(plane.base) + b1 * vfloat(plane.d1) + b2 * vfloat(plane.d2);
+    }
+
+    // 线性函数在矩形上的最值取在角点
+    inline std::pair<float, float> linearRange(const EdgeFunction& f, int x0, int y0, int x1, int y1)
+    {
+        float v00 = f.A * x0 + f.B * y0 + f.C;
+        float v10 = f.A * x1 + f.B * y0 + f.C;
+        float v01 = f.A * x0 + f.B * y1 + f.C;
+        float v11 = f.A * x1 + f.B * y1 + f.C;
+        return std::make_pair(std::min({ v00, v10, v01, v11 }), std::max({ v00, v10, v01, v11 }));
+    }
+
+    // 定点边函数转换到块内，块起点的值用64位整数计算，不会溢出
+    inline BlockEdge blockEdge(const FixedEdge& edge, int originX, int originY)
+    {
+        int64_t e0 = edge.A * ((int64_t)originX * subpixelScale) + edge.B * ((int64_t)originY * subpixelScale) + edge.C;
+
+        // 阈值为 ceil(-E0 / subpixelScale)，远超过块内范围时截断，不影响结果
+        constexpr int64_t limit = 1 << 30;
+        BlockEdge blockEdge;
+        blockEdge.A = (int)edge.A;
+        blockEdge.B = (int)edge.B;
+        blockEdge.threshold = (int)std::clamp(-(e0 >> subpixelBits), -limit, limit);
+        blockEdge.base = (float)e0 * (1.f / (subpixelScale * subpixelScale));
+        return blockEdge;
+    }
+
+    // 块内一行向量的起点处各分量的 A * dx + B * dy，之后逐向量加上A * 向量宽度
+    SIMD_INLINE vint edgeRow(const BlockEdge& edge, int dx, int dy)
+    {
+        return vint::ramp(edge.A * dx + edge.B * dy, edge.A);
+    }
+
+    // 由块内的整数边函数值得到像素单位的边函数值，着色与只写深度的光栅化必须用同样的算式
+    SIMD_INLINE vfloat edgeValue(const BlockEdge& edge, const vint& d)
+    {
+        return d.toFloat() * vfloat(1.f / subpixelScale) + vfloat(edge.base);
+    }
+
+    // 深度关于屏幕坐标的线性函数，用于估计块内的深度范围
+    inline EdgeFunction depthFunction(const RasterTriangle& triangle)
+    {
+        const EdgeFunction* edges = triangle.edges;
+        EdgeFunction depthFunc;
+        depthFunc.A = (triangle.depth.d1 * edges[1].A + triangle.depth.d2 * edges[2].A) * triangle.invArea;
+        depthFunc.B = (triangle.depth.d1 * edges[1].B + triangle.depth.d2 * edges[2].B) * triangle.invArea;
+        depthFunc.C = triangle.depth.base + (triangle.depth.d1 * edges[1].C + triangle.depth.d2 * edges[2].C) * triangle.invArea;
+        return depthFunc;
+    }
+
+    // 重新统计写过深度的块的深度范围
+    inline void updateHiZBlock(const RasterTarget& target, int blockX, int blockY)
+    {
+        int blockMinX = blockX * hizBlockSize;
+        int blockMaxX = std::min(blockMinX + hizBlockSize, target.width);
+        int blockMinY = blockY * hizBlockSize;
+        int blockMaxY = std::min(blockMinY + hizBlockSize, target.height);
+        float blockMin = std::numeric_limits<float>::max();
+        float blockMax = std::numeric_limits<float>::lowest();
+        for (int y = blockMinY; y < blockMaxY; ++y)
+        {
+            const float* pDepthRow = target.pZBuffer + y * target.stride;
+            auto [itMin, itMax] = std::minmax_element(pDepthRow + blockMinX, pDepthRow + blockMaxX);
+            blockMin = std::min(blockMin, *itMin);
+            blockMax = std::max(blockMax, *itMax);
+        }
+
+        int blockIndex = blockX + blockY * target.hizCols;
+        target.pHiZMin[blockIndex] = blockMin;
+        target.pHiZMax[blockIndex] = blockMax;
+    }
+
+    // 在裁剪区域内光栅化一个三角形
+    // 按层次深度缓冲的块遍历包围盒，不覆盖或深度上被完全遮挡的块直接跳过
+    // bDeferred为true时是延迟着色的几何阶段，执行几何着色把表面属性写到G-buffer
+    template<class ShaderT, bool bDeferred = false>
+    uint8_t rasterizeTriangle(const RasterTriangle& triangle, const ScreenRect& clipRect, const RasterTarget& target, RasterStats& stats)
+    {
+        static_assert(hizBlockSize % vfloat::size == 0, "hiz block must hold whole vectors");
+
+        // 包围盒与裁剪区域求交
+        int minX = std::max(triangle.bound.minX, clipRect.minX);
+        int minY = std::max(triangle.bound.minY, clipRect.minY);
+        int maxX = std::min(triangle.bound.maxX, clipRect.maxX);
+        int maxY = std::min(triangle.bound.maxY, clipRect.maxY);
+        if (minX > maxX || minY > maxY)
+            return CoverageNone;
+
+        ShaderT* pShader = static_cast<ShaderT*>(triangle.pIShader);
+        const EdgeFunction* edges = triangle.edges;
+
+        EdgeFunction depthFunc = depthFunction(triangle);
+        bool bEqualTest = triangle.depthTest == DepthTest::Equal;
+
+        constexpr int width = vfloat::size;
+        static_assert(vint::size == width, "int and float vectors must have the same width");
+        vfloat invArea(triangle.invArea);
+        vfloat one(1.f);
+
+        // 在任意位置做透视校正插值，用于计算2x2像素块内的差分
+        auto interpolateAt = [&](const vfloat& px, const vfloat& py, float* out)
+            {
+                vfloat b1 = (vfloat(edges[1].A) * px + vfloat(edges[1].B) * py + vfloat(edges[1].C)) * invArea;
+                vfloat b2 = (vfloat(edges[2].A) * px + vfloat(edges[2].B) * py + vfloat(edges[2].C)) * invArea;
+                vfloat w = one / interpolatePlane(triangle.invW, b1, b2);
+                for (int i = 0; i < triangle.varyingCount; ++i)
+                {
+                    (interpolatePlane(triangle.varyings[i], b1, b2) * w).storeAligned(out + i * width);
+                }
+            };
+
+        // 一个向量宽度内的像素的插值结果，按分量存放
+        alignas(32) float depth[width];
+        alignas(32) float varyings[IShader::MaxVaryings * width];
+        alignas(32) float quadOrigin[IShader::MaxVaryings * width];
+        alignas(32) float ddx[IShader::MaxVaryings * width];
+        alignas(32) float ddy[IShader::MaxVaryings * width];
+
+        IShader::FragmentInput fragInput;
+        fragInput.stride = width;
+
+        TGAColor color;
+        IShader::SurfaceData surface;
+        int64_t samples = 0; // 着色后没有被丢弃的像素数
+        bool bCovered = false; // 是否有块被三角形覆盖
+        bool bVisible = false; // 是否有块通过了层次深度测试
+        for (int blockY = minY / hizBlockSize; blockY <= maxY / hizBlockSize; ++blockY)
+        {
+            for (int blockX = minX / hizBlockSize; blockX <= maxX / hizBlockSize; ++blockX)
+            {
+                // 块与包围盒的交
+                int x0 = std::max(blockX * hizBlockSize, minX);
+                int y0 = std::max(blockY * hizBlockSize, minY);
+                int x1 = std::min(blockX * hizBlockSize + hizBlockSize - 1, maxX);
+                int y1 = std::min(blockY * hizBlockSize + hizBlockSize - 1, maxY);
+
+                // 任意一条边在整个块内都达不到阈值，块在三角形外
+                int originX = blockX * hizBlockSize;
+                int originY = blockY * hizBlockSize;
+                BlockEdge be0 = blockEdge(triangle.fixedEdges[0], originX, originY);
+                BlockEdge be1 = blockEdge(triangle.fixedEdges[1], originX, originY);
+                BlockEdge be2 = blockEdge(triangle.fixedEdges[2], originX, originY);
+                int dx0 = x0 - originX, dy0 = y0 - originY, dx1 = x1 - originX, dy1 = y1 - originY;
+                if (!be0.reaches(dx0, dy0, dx1, dy1) || !be1.reaches(dx0, dy0, dx1, dy1) || !be2.reaches(dx0, dy0, dx1, dy1))
+                    continue;
+
+                bCovered = true;
+                // 块内三角形最近的深度都不比块内最远的深度近，整个块被遮挡
+                int blockIndex = blockX + blockY * target.hizCols;
+                auto [blockNear, blockFar] = linearRange(depthFunc, x0, y0, x1, y1);
+                float nearDepth = std::max(blockNear, triangle.minDepth) - hizDepthEpsilon;
+                float farDepth = std::min(blockFar, triangle.maxDepth) + hizDepthEpsilon;
+                if (nearDepth >= target.pHiZMax[blockIndex])
+                {
+                    ++stats.hizCulledBlocks;
+                    continue;
+                }
+
+                bVisible = true;
+                // 块内三角形最远的深度也比块内最近的深度近，覆盖的像素都能通过深度测试，不用读深度缓冲
+                bool bAccept = !bEqualTest && farDepth < target.pHiZMin[blockIndex];
+                bool bWritten = false;
+
+                // 整数边函数沿x方向每次步进一个向量宽度，覆盖测试为 d > threshold - 1
+                vint step0(be0.A * width), step1(be1.A * width), step2(be2.A * width);
+                vint limit0(be0.threshold - 1), limit1(be1.threshold - 1), limit2(be2.threshold - 1);
+
+                // 向量从块内对齐的位置开始，按向量读取深度时不会越过块（以及所在的分块），其他线程可能正在写相邻的分块
+                int xStart = x0 - (x0 - originX) % width;
+
+                // 每个像素所在2x2块左上角相对向量起点的偏移，向量宽度为偶数，逐向量步进时保持不变
+                alignas(32) float quadLane[width];
+                for (int lane = 0; lane < width; ++lane)
+                {
+                    quadLane[lane] = (float)(lane - ((xStart + lane) & 1));
+                }
+                vfloat quadX = vfloat::loadAligned(quadLane);
+                for (int y = y0; y <= y1; ++y)
+                {
+                    // 行首的整数边函数值，之后只做加法
+                    vint d0 = edgeRow(be0, xStart - originX, y - originY);
+                    vint d1 = edgeRow(be1, xStart - originX, y - originY);
+                    vint d2 = edgeRow(be2, xStart - originX, y - originY);
+
+                    float* pDepthRow = target.pZBuffer + y * target.stride;
+                    for (int x = xStart; x <= x1; x += width, d0 = d0 + step0, d1 = d1 + step1, d2 = d2 + step2)
+                    {
+                        // 覆盖掩码：三条边函数都满足填充规则的像素在三角形内，行首、行尾超出[x0, x1]的分量要去掉
+                        int coverMask = ((d0 > limit0) & (d1 > limit1) & (d2 > limit2)).mask();
+                        if (x < x0)
+                            coverMask &= ~((1 << (x0 - x)) - 1);
+                        if (x1 - x + 1 < width)
+                            coverMask &= (1 << (x1 - x + 1)) - 1;
+                        if (!coverMask)
+                            continue;
+
+                        // 插值深度并与深度缓冲比较（提前深度测试）
+                        vfloat b1 = edgeValue(be1, d1) * invArea;
+                        vfloat b2 = edgeValue(be2, d2) * invArea;
+                        vfloat z = interpolatePlane(triangle.depth, b1, b2);
+                        stats.fragmentsTested += bitCount(coverMask);
+                        int passMask = coverMask;
+                        if (bEqualTest)
+                        {
+                            vfloat oldZ = vfloat::load(pDepthRow + x);
+                            passMask &= ((z <= oldZ) & (z >= oldZ)).mask();
+                        }
+                        else if (!bAccept)
+                        {
+                            passMask &= (z < vfloat::load(pDepthRow + x)).mask();
+                        }
+                        if (!passMask)
+                            continue;
+
+                        int passCount = bitCount(passMask);
+                        stats.fragmentsPassed += passCount;
+                        stats.fragmentsShaded += passCount;
+
+                        // 所有分量一起做透视校正插值
+                        vfloat w = one / interpolatePlane(triangle.invW, b1, b2);
+                        for (int i = 0; i < triangle.varyingCount; ++i)
+                        {
+                            (interpolatePlane(triangle.varyings[i], b1, b2) * w).storeAligned(varyings + i * width);
+                        }
+                        z.storeAligned(depth);
+
+                        // 在2x2块的左上、右上、左下三个位置插值，求差分，块内的像素共用
+                        if (triangle.useDerivatives)
+                        {
+                            vfloat qx = vfloat((float)x) + quadX;
+                            vfloat qy((float)(y & ~1));
+                            interpolateAt(qx, qy, quadOrigin);
+                            interpolateAt(qx + one, qy, ddx);
+                            interpolateAt(qx, qy + one, ddy);
+                            for (int i = 0; i < triangle.varyingCount * width; i += width)
+                            {
+                                vfloat origin = vfloat::loadAligned(quadOrigin + i);
+                                (vfloat::loadAligned(ddx + i) - origin).storeAligned(ddx + i);
+                                (vfloat::loadAligned(ddy + i) - origin).storeAligned(ddy + i);
+                            }
+                        }
+
+                        // 只对通过深度测试的像素着色
+                        // 深度逐个写回，不能整向量写入，相邻分块可能正由其他线程写入
+                        for (int lane = 0; lane < width; ++lane)
+                        {
+                            if (!(passMask & (1 << lane)))
+                                continue;
+
+                            if (!bEqualTest)
+                            {
+                                pDepthRow[x + lane] = depth[lane]; // 更新深度缓冲
+                                bWritten = true;
+                            }
+                            countOverdraw(target, x + lane, y);
+
+                            fragInput.fragCoord = Vec3f((float)(x + lane), (float)y, depth[lane]);
+                            fragInput.pVaryings = varyings + lane;
+                            fragInput.pDdx = ddx + lane;
+                            fragInput.pDdy = ddy + lane;
+                            if constexpr (bDeferred)
+                            {
+                                // 只记录表面属性，光照留到flush时对最终可见的像素执行
+                                surface = IShader::SurfaceData();
+                                if (shadeGeometry(pShader, fragInput, surface))
+                                {
+                                    ++stats.fragmentsDiscarded;
+                                    continue;
+                                }
+
+                                surface.lightingIndex = triangle.lightingIndex;
+                                target.pSurface[(size_t)y * target.stride + x + lane] = surface;
+                            }
+                            else
+                            {
+                                if (shadeFragment(pShader, fragInput, color)) // 执行片段着色器，主要就是确定该像素的颜色
+                                {
+                                    ++stats.fragmentsDiscarded;
+                                    continue;
+                                }
+
+                                // 只有不被丢弃的像素才填充颜色
+                                writeColor(target, x + lane, y, color);
+                            }
+                            writeVisibility(target, x + lane, y, triangle.id);
+                            ++samples;
+                        }
+                    }
+                }
+
+                // 写过深度的块重新统计深度范围
+                if (bWritten)
+                    updateHiZBlock(target, blockX, blockY);
+            }
+        }
+
+        addQuerySamples(triangle, samples);
+        return (uint8_t)((bCovered ? CoverageBlocks : CoverageNone) | (bVisible ? CoverageVisible : CoverageNone));
+    }
+
+    // 只写深度的光栅化，不插值属性也不执行片段着色器
+    // 向量从块的起点开始，不会跨过块（也就不会跨过分块），可以整向量写回深度
+    inline uint8_t rasterizeDepth(const RasterTriangle& triangle, const ScreenRect& clipRect, const RasterTarget& target, RasterStats& stats)
+    {
+        int minX = std::max(triangle.bound.minX, clipRect.minX);
+        int minY = std::max(triangle.bound.minY, clipRect.minY);
+        int maxX = std::min(triangle.bound.maxX, clipRect.maxX);
+        int maxY = std::min(triangle.bound.maxY, clipRect.maxY);
+        if (minX > maxX || minY > maxY)
+            return CoverageNone;
+
+        EdgeFunction depthFunc = depthFunction(triangle);
+
+        constexpr int width = vfloat::size;
+        vfloat invArea(triangle.invArea);
+        vint rangeMinX(minX - 1), rangeMaxX(maxX + 1);
+
+        int64_t samples = 0;
+        bool bCovered = false;
+        bool bVisible = false;
+        for (int blockY = minY / hizBlockSize; blockY <= maxY / hizBlockSize; ++blockY)
+        {
+            for (int blockX = minX / hizBlockSize; blockX <= maxX / hizBlockSize; ++blockX)
+            {
+                int x0 = std::max(blockX * hizBlockSize, minX);
+                int y0 = std::max(blockY * hizBlockSize, minY);
+                int x1 = std::min(blockX * hizBlockSize + hizBlockSize - 1, maxX);
+                int y1 = std::min(blockY * hizBlockSize + hizBlockSize - 1, maxY);
+                int originX = blockX * hizBlockSize;
+                int originY = blockY * hizBlockSize;
+                BlockEdge be0 = blockEdge(triangle.fixedEdges[0], originX, originY);
+                BlockEdge be1 = blockEdge(triangle.fixedEdges[1], originX, originY);
+                BlockEdge be2 = blockEdge(triangle.fixedEdges[2], originX, originY);
+                int dx0 = x0 - originX, dy0 = y0 - originY, dx1 = x1 - originX, dy1 = y1 - originY;
+                if (!be0.reaches(dx0, dy0, dx1, dy1) || !be1.reaches(dx0, dy0, dx1, dy1) || !be2.reaches(dx0, dy0, dx1, dy1))
+                    continue;
+
+                bCovered = true;
+                int blockIndex = blockX + blockY * target.hizCols;
+                float nearDepth = std::max(linearRange(depthFunc, x0, y0, x1, y1).first, triangle.minDepth) - hizDepthEpsilon;
+                if (nearDepth >= target.pHiZMax[blockIndex])
+                {
+                    ++stats.hizCulledBlocks;
+                    continue;
+                }
+
+                bVisible = true;
+                vint limit0(be0.threshold - 1), limit1(be1.threshold - 1), limit2(be2.threshold - 1);
+                bool bWritten = false;
+                for (int y = y0; y <= y1; ++y)
+                {
+                    float* pDepthRow = target.pZBuffer + y * target.stride;
+                    for (int x = originX; x < originX + hizBlockSize; x += width)
+                    {
+                        // 整数边函数是精确的，直接求值与着色时逐向量累加的结果一致
+                        vint d0 = edgeRow(be0, x - originX, y - originY);
+                        vint d1 = edgeRow(be1, x - originX, y - originY);
+                        vint d2 = edgeRow(be2, x - originX, y - originY);
+                        vint laneX = vint::ramp(x, 1);
+                        vint coverBits = (d0 > limit0) & (d1 > limit1) & (d2 > limit2) & (laneX > rangeMinX) & (rangeMaxX > laneX);
+                        int coverMask = coverBits.mask();
+                        if (!coverMask)
+                            continue;
+
+                        // 覆盖的分量为-1，转换为浮点后与0比较得到浮点掩码
+                        vfloat cover = coverBits.toFloat() < vfloat(0.f);
+                        stats.fragmentsTested += bitCount(coverMask);
+                        vfloat z = interpolatePlane(triangle.depth, edgeValue(be1, d1) * invArea, edgeValue(be2, d2) * invArea);
+                        vfloat oldZ = vfloat::load(pDepthRow + x);
+                        vfloat pass = cover & (z < oldZ);
+                        int passMask = pass.mask();
+                        if (!passMask)
+                            continue;
+
+                        select(pass, z, oldZ).store(pDepthRow + x);
+                        bWritten = true;
+
+                        int passCount = bitCount(passMask);
+                        samples += passCount;
+                        stats.fragmentsPassed += passCount;
+                        if (target.pVisibility || target.pOverdraw)
+                        {
+                            for (int lane = 0; lane < width; ++lane)
+                            {
+                                if (!(passMask & (1 << lane)))
+                                    continue;
+
+                                writeVisibility(target, x + lane, y, triangle.id);
+                                countOverdraw(target, x + lane, y);
+                            }
+                        }
+                    }
+                }
+
+                if (bWritten)
+                    updateHiZBlock(target, blockX, blockY);
+            }
+        }
+
+        addQuerySamples(triangle, samples);
+        return (uint8_t)((bCovered ? CoverageBlocks : CoverageNone) | (bVisible ? CoverageVisible : CoverageNone));
+    }
+
+    // 消隐线框的深度偏移，线段与所在的面深度几乎相同，偏移避免被自身的面遮挡
+    constexpr float lineDepthBias = 1e-4f;
+
+    // 光栅化线段在clipRect内的部分，沿主方向每步一个像素，副方向取最近的像素
+    // 每个像素的位置只由线段本身决定，与clipRect无关，按横条拆开绘制与整体绘制的结果相同
+    // bDepthTest为true时与深度缓冲比较，不写入深度
+    inline void rasterizeLine(const ScreenLine& line, const ScreenRect& clipRect, const RasterTarget& target, const TGAColor& color, bool bDepthTest)
+    {
+        Vec3f p0 = line.p0;
+        Vec3f p1 = line.p1;
+        bool bSteep = std::abs(p1.y - p0.y) > std::abs(p1.x - p0.x);
+        // 转换到主方向为x，并从左到右遍历
+        if (bSteep)
+        {
+            std::swap(p0.x, p0.y);
+            std::swap(p1.x, p1.y);
+        }
+        if (p0.x > p1.x)
+            std::swap(p0, p1);
+
+        int minMajor = bSteep ? clipRect.minY : clipRect.minX;
+        int maxMajor = bSteep ? clipRect.maxY : clipRect.maxX;
+        int minMinor = bSteep ? clipRect.minX : clipRect.minY;
+        int maxMinor = bSteep ? clipRect.maxX : clipRect.maxY;
+
+        float length = p1.x - p0.x;
+        float slope = length > 0.f ? (p1.y - p0.y) / length : 0.f;
+        float depthSlope = length > 0.f ? (p1.z - p0.z) / length : 0.f;
+
+        int start = std::max((int)std::floor(p0.x + 0.5f), minMajor);
+        int end = std::min((int)std::floor(p1.x + 0.5f), maxMajor);
+
+        // 副方向只有一部分在clipRect内时，先按斜率缩小主方向的范围（多留一个像素），之后逐像素判断
+        if (slope != 0.f)
+        {
+            float a = p0.x + (minMinor - 0.5f - p0.y) / slope;
+            float b = p0.x + (maxMinor + 0.5f - p0.y) / slope;
+            if (a > b)
+                std::swap(a, b);
+
+            start = (int)std::max((float)start, std::floor(a) - 1.f);
+            end = (int)std::min((float)end, std::ceil(b) + 1.f);
+        }
+
+        for (int major = start; major <= end; ++major)
+        {
+            float t = (float)major - p0.x;
+            int minor = (int)std::floor(p0.y + t * slope + 0.5f);
+            if (minor < minMinor || minor > maxMinor)
+                continue;
+
+            int x = bSteep ? minor : major;
+            int y = bSteep ? major : minor;
+            if (bDepthTest && p0.z + t * depthSlope > target.pZBuffer[y * target.stride + x] + lineDepthBias)
+                continue;
+
+            writeColor(target, x, y, color);
+        }
+    }
+
+    // 按着色器类型实例化一次绘制的各阶段
+    template<class ShaderT>
+    DrawKernel makeDrawKernel(ShaderT& shader)
+    {
+        static_assert(std::is_base_of_v<IShader, ShaderT>, "ShaderT must derive from IShader");
+
+        DrawKernel kernel;
+        kernel.pIShader = &shader;
+        kernel.pVertex = &shadeVertex<ShaderT>;
+        kernel.pRasterize = &rasterizeTriangle<ShaderT>;
+        kernel.pRasterizeGeometry = &rasterizeTriangle<ShaderT, true>;
+        kernel.pLighting = &shadeLighting<ShaderT>;
+        kernel.varyingCount = std::clamp(shader.varyingCount(), 0, IShader::MaxVaryings);
+        kernel.useDerivatives = shader.useDerivatives();
+        return kernel;
+    }
+}
+
+#endif // !__RASTERPIPELINE_H__
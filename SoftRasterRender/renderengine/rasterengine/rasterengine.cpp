@@ -1,7 +1,82 @@
 ﻿#include "stdafx.h"
+#include <chrono>
+#include "threadpool.h"
+#include "simd.h"
 #include "common.h"
 #include "rasterengine.h"
 
+namespace
+{
+	// 并行光栅化时屏幕分块的边长（像素）
+	constexpr int tileSize = 64;
+	// 层次深度缓冲的块不能跨越分块，否则并行时会被多个线程同时更新
+	static_assert(tileSize % RasterPipeline::hizBlockSize == 0, "tile must hold whole hiz blocks");
+
+	// 保护带的范围（NDC），三角形只有超出保护带或穿过近平面时才在齐次空间裁剪
+	// 保护带内的部分由包围盒与屏幕求交处理，范围不能太大，否则边函数在float下不再精确
+	constexpr float guardBand = 2.f;
+
+	// 顶点相对各平面的位置（outcode），置位表示在该平面外侧
+	constexpr int clipLeft = 1 << 0; // x < -w
+	constexpr int clipRight = 1 << 1; // x > w
+	constexpr int clipBottom = 1 << 2; // y < -w
+	constexpr int clipTop = 1 << 3; // y > w
+	constexpr int clipNear = 1 << 4; // z < -w，包括相机后方的点
+	constexpr int clipFar = 1 << 5; // z > w
+	constexpr int guardLeft = 1 << 6; // x < -guardBand * w
+	constexpr int guardRight = 1 << 7;
+	constexpr int guardBottom = 1 << 8;
+	constexpr int guardTop = 1 << 9;
+
+	// 需要真正裁剪的平面，远平面之外的像素深度大于1，由深度测试丢弃
+	constexpr int clipPlanes[] = { clipNear, guardLeft, guardRight, guardBottom, guardTop };
+
+	// 统计各阶段耗时用的时钟
+	using Clock = std::chrono::steady_clock;
+
+	double elapsedMs(Clock::time_point start, Clock::time_point end)
+	{
+		return std::chrono::duration<double, std::milli>(end - start).count();
+	}
+
+	int computeOutCode(const Vec4f& pos)
+	{
+		float x = pos[0], y = pos[1], z = pos[2], w = pos[3];
+		int outCode = 0;
+		outCode |= x < -w ? clipLeft : 0;
+		outCode |= x > w ? clipRight : 0;
+		outCode |= y < -w ? clipBottom : 0;
+		outCode |= y > w ? clipTop : 0;
+		outCode |= z < -w ? clipNear : 0;
+		outCode |= z > w ? clipFar : 0;
+		outCode |= x < -guardBand * w ? guardLeft : 0;
+		outCode |= x > guardBand * w ? guardRight : 0;
+		outCode |= y < -guardBand * w ? guardBottom : 0;
+		outCode |= y > guardBand * w ? guardTop : 0;
+		return outCode;
+	}
+
+	// 到裁剪平面的有向距离，不小于0为内侧
+	float planeDistance(const Vec4f& pos, int plane)
+	{
+		switch (plane)
+		{
+		case clipNear:
+			return pos[2] + pos[3];
+		case guardLeft:
+			return pos[0] + guardBand * pos[3];
+		case guardRight:
+			return guardBand * pos[3] - pos[0];
+		case guardBottom:
+			return pos[1] + guardBand * pos[3];
+		case guardTop:
+			return guardBand * pos[3] - pos[1];
+		default:
+			return 0.f;
+		}
+	}
+}
+
 Matrix RasterEngine::lookat(Vec3f cameraPos, Vec3f target, Vec3f up)
 {
 	return RenderEngine::lookat(cameraPos, target, up);
@@ -36,11 +111,40 @@ std::tuple<Vec3f, Vec3f> RasterEngine::computeTangentSpace(const Vec3f* pos, con
 
 void RasterEngine::setDevice(TGAImage* device)
 {
+	// 缓存的三角形属于之前的设备，先画完，但不再解析到之前的设备
+	// 一帧结束时调用者已经flush过，之前的设备可能已经释放或者被修改
+	_flushTiles();
+
 	m_pDevice = device;
 	m_width = device->get_width();
 	m_height = device->get_height();
-	m_zBuffer = std::make_unique<float[]>(m_width * m_height);
-	std::fill_n(m_zBuffer.get(), m_width * m_height, 1.f);
+
+	// 尺寸不变时复用渲染目标的内存，只做清空
+	m_bDeferred = m_shadingMode == RasterPipeline::ShadingMode::Deferred;
+	int optionalPlanes = (m_bVisibility ? RenderTarget::VisibilityPlane : 0) | (m_bDeferred ? RenderTarget::SurfacePlane : 0);
+	m_renderTarget.resize(m_width, m_height, m_colorFormat, optionalPlanes);
+	m_renderTarget.clear(TGAColor(0, 0, 0, 0), 1.f);
+	m_stats = RasterPipeline::PipelineStats();
+	m_lightingKernels.clear(); // G-buffer已清空，之前的下标不再使用
+
+	m_tileCols = (m_width + tileSize - 1) / tileSize;
+	m_tileRows = (m_height + tileSize - 1) / tileSize;
+	_resetTiles();
+}
+
+void RasterEngine::setDepthTest(const RasterPipeline::DepthTest depthTest)
+{
+	m_depthTest = depthTest;
+}
+
+void RasterEngine::setColorFormat(const RasterPipeline::ColorFormat format)
+{
+	m_colorFormat = format;
+}
+
+void RasterEngine::setShadingMode(const RasterPipeline::ShadingMode mode)
+{
+	m_shadingMode = mode;
 }
 
 void RasterEngine::setShader(IShader* pIShader)
@@ -48,6 +152,215 @@ void RasterEngine::setShader(IShader* pIShader)
 	m_pIShader = pIShader;
 }
 
+void RasterEngine::setExecuteType(const ExecutexType type)
+{
+	// 切换前先把已缓存的三角形画完，保证绘制顺序
+	_flushTiles();
+	m_executeType = type;
+}
+
+void RasterEngine::flush()
+{
+	_flushTiles();
+
+	// 几何阶段全部完成后，每个可见像素只做一次光照
+	if (m_bDeferred)
+		_lightingPass();
+
+	// 一帧结束，渲染目标一次性转换到设备
+	if (m_pDevice)
+	{
+		Clock::time_point start = Clock::now();
+		m_renderTarget.resolve(m_pDevice);
+		m_stats.resolveTime += elapsedMs(start, Clock::now());
+	}
+
+	// 没有绘制三角形的flush（例如连续调用两次）不覆盖上一帧的统计
+	m_renderTarget.collectOverdraw(m_stats.overdraw, RasterPipeline::PipelineStats::overdrawBins);
+	if (m_stats.inputTriangles > 0)
+		m_frameStats = m_stats;
+	m_stats = RasterPipeline::PipelineStats();
+}
+
+void RasterEngine::_flushTiles()
+{
+	if (m_triangles.empty())
+		return;
+
+	// 每个分块只写自己范围内的深度与颜色，互不重叠，因此不需要加锁
+	// 分块内按提交顺序光栅化三角形，深度测试的结果与单线程逐个绘制完全一致
+	Clock::time_point start = Clock::now();
+	ThreadPool& threadPool = ThreadPool::instance();
+	std::vector<std::future<RasterPipeline::RasterStats>> taskFutures;
+	for (int tileIndex = 0; tileIndex < (int)m_tileBins.size(); ++tileIndex)
+	{
+		if (m_tileBins[tileIndex].empty())
+			continue;
+
+		auto future = threadPool.commit([this, tileIndex]
+			{
+				ScreenRect tileRect;
+				tileRect.minX = (tileIndex % m_tileCols) * tileSize;
+				tileRect.minY = (tileIndex / m_tileCols) * tileSize;
+				tileRect.maxX = std::min(tileRect.minX + tileSize, m_width) - 1;
+				tileRect.maxY = std::min(tileRect.minY + tileSize, m_height) - 1;
+
+				// 统计先在分块内累计，最后再汇总
+				RasterPipeline::RasterStats tileStats;
+				const std::vector<int>& bin = m_tileBins[tileIndex];
+				std::vector<uint8_t>& coverage = m_tileCoverage[tileIndex];
+				coverage.resize(bin.size());
+				for (size_t i = 0; i < bin.size(); ++i)
+					coverage[i] = _rasterizeTriangle(m_triangles[bin[i]], tileRect, tileStats);
+
+				return tileStats;
+			});
+
+		taskFutures.push_back(std::move(future));
+	}
+
+	// 等待所有分块完成
+	for (auto& future : taskFutures)
+	{
+		m_stats.raster += future.get();
+	}
+
+	// 合并三角形在各分块的结果，在所有分块中都没有可见的块才算被层次深度剔除
+	m_triangleCoverage.assign(m_triangles.size(), RasterPipeline::CoverageNone);
+	for (int tileIndex = 0; tileIndex < (int)m_tileBins.size(); ++tileIndex)
+	{
+		const std::vector<int>& bin = m_tileBins[tileIndex];
+		for (size_t i = 0; i < bin.size(); ++i)
+			m_triangleCoverage[bin[i]] |= m_tileCoverage[tileIndex][i];
+	}
+	m_stats.culledHiZ += std::count(m_triangleCoverage.begin(), m_triangleCoverage.end(), RasterPipeline::CoverageBlocks);
+	m_stats.rasterTime += elapsedMs(start, Clock::now());
+
+	_resetTiles();
+}
+
+void RasterEngine::_lightingPass()
+{
+	if (m_lightingKernels.empty())
+		return;
+
+	Clock::time_point start = Clock::now();
+	RasterPipeline::RasterTarget target = m_renderTarget.rasterTarget();
+	auto tileRectOf = [this](int tileIndex)
+		{
+			ScreenRect tileRect;
+			tileRect.minX = (tileIndex % m_tileCols) * tileSize;
+			tileRect.minY = (tileIndex / m_tileCols) * tileSize;
+			tileRect.maxX = std::min(tileRect.minX + tileSize, m_width) - 1;
+			tileRect.maxY = std::min(tileRect.minY + tileSize, m_height) - 1;
+			return tileRect;
+		};
+
+	int tileCount = m_tileCols * m_tileRows;
+	if (m_executeType == ExecutexType::Synchronous)
+	{
+		for (int tileIndex = 0; tileIndex < tileCount; ++tileIndex)
+			m_stats.lightingInvocations += _lightTile(tileRectOf(tileIndex), target);
+	}
+	else
+	{
+		// 每个像素只读写自己的G-buffer与颜色，分块之间没有依赖
+		ThreadPool& threadPool = ThreadPool::instance();
+		std::vector<std::future<int64_t>> taskFutures;
+		for (int tileIndex = 0; tileIndex < tileCount; ++tileIndex)
+		{
+			taskFutures.push_back(threadPool.commit([this, &target, tileRect = tileRectOf(tileIndex)]
+				{
+					return _lightTile(tileRect, target);
+				}));
+		}
+
+		for (auto& future : taskFutures)
+		{
+			m_stats.lightingInvocations += future.get();
+		}
+	}
+
+	m_stats.lightingTime += elapsedMs(start, Clock::now());
+}
+
+int64_t RasterEngine::_lightTile(const ScreenRect& rect, const RasterPipeline::RasterTarget& target)
+{
+	TGAColor color;
+	int64_t invocations = 0;
+	for (int y = rect.minY; y <= rect.maxY; ++y)
+	{
+		const IShader::SurfaceData* pSurfaceRow = target.pSurface + (size_t)y * target.stride;
+		const float* pDepthRow = target.pZBuffer + (size_t)y * target.stride;
+		for (int x = rect.minX; x <= rect.maxX; ++x)
+		{
+			const IShader::SurfaceData& surface = pSurfaceRow[x];
+			if (surface.lightingIndex == IShader::SurfaceData::noSurface)
+				continue;
+
+			const LightingKernel& kernel = m_lightingKernels[surface.lightingIndex];
+			kernel.pLighting(kernel.pIShader, Vec3f((float)x, (float)y, pDepthRow[x]), surface, color);
+			RasterPipeline::writeColor(target, x, y, color);
+			++invocations;
+		}
+	}
+
+	return invocations;
+}
+
+RasterPipeline::PipelineStats RasterEngine::getPipelineStats() const
+{
+	return m_frameStats;
+}
+
+void RasterEngine::setVisibilityBuffer(bool bEnable)
+{
+	m_bVisibility = bEnable;
+}
+
+void RasterEngine::setDrawID(uint32_t drawID)
+{
+	m_drawID = drawID;
+}
+
+RasterPipeline::VisibilityBuffer RasterEngine::getVisibilityBuffer()
+{
+	_flushTiles();
+	return m_renderTarget.visibilityBuffer();
+}
+
+void RasterEngine::beginQuery(int query)
+{
+	if (query < 0)
+		return;
+
+	// 重复使用的查询可能还有缓存的三角形在累计上一次的结果，先画完
+	if (query < (int)m_querySamples.size())
+		_flushTiles();
+
+	while ((int)m_querySamples.size() <= query)
+	{
+		m_querySamples.emplace_back(0);
+	}
+
+	m_querySamples[query] = 0;
+	m_activeQuery = query;
+}
+
+void RasterEngine::endQuery()
+{
+	m_activeQuery = -1;
+}
+
+int64_t RasterEngine::getQueryResult(int query)
+{
+	if (query < 0 || query >= (int)m_querySamples.size())
+		return 0;
+
+	_flushTiles();
+	return m_querySamples[query].load();
+}
+
 void RasterEngine::drawLine(Vec2i start, Vec2i end, TGAColor color)
 {
 	drawLine(start.x, start.y, end.x, end.y, color);
@@ -55,6 +368,8 @@ void RasterEngine::drawLine(Vec2i start, Vec2i end, TGAColor color)
 
 void RasterEngine::drawLine(int x0, int y0, int x1, int y1, TGAColor color)
 {
+	_flushTiles(); // 逐像素写入，需要先完成缓存的三角形
+
 	bool bSteep = std::abs(x0 - x1) < std::abs(y0 - y1);
 	// 转换到像素点更多的那一个分量
 	if (bSteep)
@@ -78,9 +393,9 @@ void RasterEngine::drawLine(int x0, int y0, int x1, int y1, TGAColor color)
 	for (int x = x0; x <= x1; ++x)
 	{
 		if (bSteep)
-			m_pDevice->set(y, x, color);
+			m_renderTarget.setColor(y, x, color);
 		else
-			m_pDevice->set(x, y, color);
+			m_renderTarget.setColor(x, y, color);
 
 		error2 += derror2;
 		if (error2 > dx)
@@ -91,8 +406,49 @@ void RasterEngine::drawLine(int x0, int y0, int x1, int y1, TGAColor color)
 	}
 }
 
+void RasterEngine::drawWireframe(const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count, TGAColor color, bool bDepthTest)
+{
+	if (!m_pIShader || !vertexStreams.pVert || !_validIndices(vertexStreams, indexBuffer, count))
+		return;
+
+	_flushTiles(); // 线框直接写入渲染目标，需要先完成缓存的三角形
+
+	// 收集三角形的三条边，端点索引小的在高位拼成键，排序去重后共享的边只剩一条
+	int triangleCount = count / 3;
+	m_edgeKeys.clear();
+	m_edgeKeys.reserve(triangleCount * 3);
+	for (int i = 0; i < triangleCount * 3; i += 3)
+	{
+		for (int j = 0; j < 3; ++j)
+		{
+			uint32_t a = (uint32_t)indexBuffer[i + j];
+			uint32_t b = (uint32_t)indexBuffer[i + (j + 1) % 3];
+			m_edgeKeys.push_back(((uint64_t)std::min(a, b) << 32) | std::max(a, b));
+		}
+	}
+	std::sort(m_edgeKeys.begin(), m_edgeKeys.end());
+	m_edgeKeys.erase(std::unique(m_edgeKeys.begin(), m_edgeKeys.end()), m_edgeKeys.end());
+
+	// 顶点阶段与索引绘制相同，只使用位置
+	RasterPipeline::DrawKernel kernel = _depthKernel();
+	_shadeVertices(kernel, vertexStreams, indexBuffer, triangleCount * 3);
+
+	// 每条边只裁剪一次，转换为屏幕空间的线段
+	m_lines.clear();
+	for (uint64_t key : m_edgeKeys)
+	{
+		RasterPipeline::ScreenLine line;
+		if (_clipLine(m_vertexCache[key >> 32], m_vertexCache[key & 0xffffffff], kernel.pIShader->m_viewportMatrix, line))
+			m_lines.push_back(line);
+	}
+
+	_rasterizeLines(color, bDepthTest);
+}
+
 void RasterEngine::drawTriangle(Vec3f v0, Vec3f v1, Vec3f v2, TGAColor color)
 {
+	_flushTiles(); // 逐像素写入，需要先完成缓存的三角形
+
 	// 按y轴排序
 	if (v0.y > v1.y)
 		std::swap(v0, v1);
@@ -124,7 +480,7 @@ void RasterEngine::drawTriangle(Vec3f v0, Vec3f v1, Vec3f v2, TGAColor color)
 					std::swap(boundPoint0, boundPoint1);
 
 				for (int x = (int)(boundPoint0.x); x <= (int)(boundPoint1.x); ++x)
-					m_pDevice->set(x, y, color);
+					m_renderTarget.setColor(x, y, color);
 			}
 		};
 
@@ -133,139 +489,583 @@ void RasterEngine::drawTriangle(Vec3f v0, Vec3f v1, Vec3f v2, TGAColor color)
 }
 
 void RasterEngine::drawTriangle(const IShader::VertexInput& input)
+{
+	if (!input.pVert)
+		return;
+
+	// 转成只有三个顶点的顶点流，走索引绘制的流程
+	IShader::VertexStreams vertexStreams;
+	vertexStreams.pVert = input.pVert->data();
+	vertexStreams.count = 3;
+	if (input.pUV)
+		vertexStreams.pUV = input.pUV->data();
+	if (input.pNorm)
+		vertexStreams.pNorm = input.pNorm->data();
+
+	std::array<Vec3f, 3> tangents;
+	std::array<Vec3f, 3> bitangents;
+	if (input.pTangent)
+	{
+		tangents.fill(std::get<0>(input.pTangent.value()));
+		bitangents.fill(std::get<1>(input.pTangent.value()));
+		vertexStreams.pTangent = tangents.data();
+		vertexStreams.pBitangent = bitangents.data();
+	}
+
+	constexpr int indices[3] = { 0, 1, 2 };
+	drawIndexed(vertexStreams, indices, 3);
+}
+
+void RasterEngine::drawIndexed(const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count)
 {
 	// 必须设置shader
 	if (!m_pIShader)
 		return;
 
-	// 执行顶点着色器
-	IShader::VertexOutput vertexOutput = _executeVertex(input);
-	if (!vertexOutput.pPos)
+	// 通过虚函数调用着色器
+	drawIndexed(RasterPipeline::makeDrawKernel(*m_pIShader), vertexStreams, indexBuffer, count);
+}
+
+void RasterEngine::drawIndexedInstanced(const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count, const IShader::InstanceData* pInstances, int instanceCount)
+{
+	if (!m_pIShader)
+		return;
+
+	drawIndexedInstanced(RasterPipeline::makeDrawKernel(*m_pIShader), vertexStreams, indexBuffer, count, pInstances, instanceCount);
+}
+
+void RasterEngine::drawDepth(const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count, DepthMap* pDepthMap)
+{
+	if (!m_pIShader)
+		return;
+
+	m_pDepthMap = pDepthMap;
+	drawIndexed(_depthKernel(), vertexStreams, indexBuffer, count);
+	m_pDepthMap = nullptr;
+}
+
+void RasterEngine::drawDepthInstanced(const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count, const IShader::InstanceData* pInstances, int instanceCount, DepthMap* pDepthMap)
+{
+	if (!m_pIShader)
 		return;
 
-	Vec3f pVert[3] = { vertexOutput.pPos.value()[0], vertexOutput.pPos.value()[1], vertexOutput.pPos.value()[2] };
+	m_pDepthMap = pDepthMap;
+	drawIndexedInstanced(_depthKernel(), vertexStreams, indexBuffer, count, pInstances, instanceCount);
+	m_pDepthMap = nullptr;
+}
+
+RasterPipeline::DrawKernel RasterEngine::_depthKernel() const
+{
+	// 只需要顶点着色器输出的位置，光栅化换成只写深度的版本
+	RasterPipeline::DrawKernel kernel = RasterPipeline::makeDrawKernel(*m_pIShader);
+	kernel.pRasterize = &RasterPipeline::rasterizeDepth;
+	kernel.varyingCount = 0;
+	kernel.useDerivatives = false;
+	kernel.depthOnly = true;
+	return kernel;
+}
+
+void RasterEngine::drawIndexed(const RasterPipeline::DrawKernel& kernel, const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count)
+{
+	if (!kernel.pIShader || !vertexStreams.pVert || !_validIndices(vertexStreams, indexBuffer, count))
+		return;
+
+	_beginDraw(kernel);
+	_assembleTriangles(kernel, vertexStreams, indexBuffer, count, 0);
+}
+
+void RasterEngine::drawIndexedInstanced(const RasterPipeline::DrawKernel& kernel, const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count, const IShader::InstanceData* pInstances, int instanceCount)
+{
+	if (!kernel.pIShader || !vertexStreams.pVert || !pInstances || !_validIndices(vertexStreams, indexBuffer, count))
+		return;
 
-	// 计算包围盒，即左上和右下
-	Vec2f  leftTop(std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
-	Vec2f  rightBottom(0.f, 0.f);
-	Vec2f  clamp(m_width - 1.f, m_height - 1.f);
+	_beginDraw(kernel);
 
-	for (int i = 0; i < 3; ++i)
+	// 顶点数据共享，每个实例只替换实例属性，变换后顶点缓存随实例失效
+	// 并行模式下各实例的三角形按提交顺序进入分块，与逐个绘制的结果相同
+	IShader::VertexStreams instanceStreams = vertexStreams;
+	for (int i = 0; i < instanceCount; ++i)
 	{
-		leftTop.x = std::max(0.f, std::min(pVert[i].x, leftTop.x));
-		leftTop.y = std::max(0.f, std::min(pVert[i].y, leftTop.y));
+		instanceStreams.pInstance = pInstances + i;
+		instanceStreams.instanceID = i;
+		_assembleTriangles(kernel, instanceStreams, indexBuffer, count, (uint32_t)(i * (count / 3)));
+	}
+}
+
+void RasterEngine::_beginDraw(const RasterPipeline::DrawKernel& kernel)
+{
+	kernel.pIShader->resolveTextures(); // 每次绘制解析一次纹理
+
+	// 延迟着色时记下光照阶段要用的着色器，同一个着色器只记录一次
+	if (!m_bDeferred || !kernel.pLighting)
+		return;
+
+	auto itemKernel = std::find_if(m_lightingKernels.begin(), m_lightingKernels.end(), [&](const LightingKernel& item)
+		{
+			return item.pIShader == kernel.pIShader && item.pLighting == kernel.pLighting;
+		});
+	if (itemKernel == m_lightingKernels.end())
+		itemKernel = m_lightingKernels.insert(m_lightingKernels.end(), LightingKernel{ kernel.pIShader, kernel.pLighting });
 
-		rightBottom.x = std::min(clamp.x, std::max(pVert[i].x, rightBottom.x));
-		rightBottom.y = std::min(clamp.y, std::max(pVert[i].y, rightBottom.y));
+	m_lightingIndex = (uint32_t)(itemKernel - m_lightingKernels.begin());
+}
+
+void RasterEngine::_shadeVertices(const RasterPipeline::DrawKernel& kernel, const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count)
+{
+	IShader* pIShader = kernel.pIShader;
+
+	// 变换后的顶点缓存，每个被引用的顶点只执行一次顶点着色器
+	// 递增批次号使之前的缓存全部失效，不用每次清空整个缓存
+	if (++m_batch == 0)
+	{
+		std::fill(m_vertexBatch.begin(), m_vertexBatch.end(), 0);
+		m_batch = 1;
+	}
+	if ((int)m_vertexCache.size() < vertexStreams.count)
+	{
+		m_vertexCache.resize(vertexStreams.count);
+		m_vertexBatch.resize(vertexStreams.count, 0);
 	}
 
-	// 执行光栅化，主要功能有两个，确定哪些像素在三角形内、插值各个顶点的属性
-	// 遍历在包围盒中的像素，判断是否在三角形内
-	Vec3f point;
-	TGAColor color;
-	for (point.x = leftTop.x; point.x <= rightBottom.x; ++point.x)
+	// 对所有引用到的顶点执行顶点着色器，图元装配时直接取缓存
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < count; ++i)
+	{
+		int index = indexBuffer[i];
+		if (m_vertexBatch[index] == m_batch)
+			continue;
+
+		ClipVertex& vertex = m_vertexCache[index];
+		vertex.clipPos = kernel.pVertex(pIShader, vertexStreams, index, vertex.output.varyings);
+		vertex.outCode = computeOutCode(vertex.clipPos);
+		// 穿过近平面的顶点w可能不为正，只有裁剪后的顶点才能做透视除法
+		if (!(vertex.outCode & clipNear))
+		{
+			vertex.output.pos = vertex.clipPos;
+			_transViewportCoords(vertex.output.pos, pIShader->m_viewportMatrix); // 执行透视除法并转换到视口坐标
+		}
+		m_vertexBatch[index] = m_batch;
+		++m_stats.vertexInvocations;
+	}
+	m_stats.vertexTime += elapsedMs(start, Clock::now());
+}
+
+void RasterEngine::_assembleTriangles(const RasterPipeline::DrawKernel& kernel, const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count, uint32_t primitiveBase)
+{
+	// 顶点阶段
+	int triangleCount = count / 3;
+	_shadeVertices(kernel, vertexStreams, indexBuffer, triangleCount * 3);
+
+	// 立即光栅化时（同步模式或写入独立的深度图）每个三角形建立后马上光栅化，两个阶段交错执行
+	// 只对整个绘制计时一次并计入光栅化，逐个三角形读时钟的开销与光栅化小三角形相当
+	bool bImmediate = m_pDepthMap || m_executeType == ExecutexType::Synchronous;
+	Clock::time_point start = Clock::now();
+	m_stats.inputTriangles += triangleCount;
+
+	// 图元装配，从缓存中取出三个顶点组成三角形
+	for (int i = 0; i < triangleCount * 3; i += 3)
 	{
-		for (point.y = leftTop.y; point.y <= rightBottom.y; ++point.y)
+		const ClipVertex& v0 = m_vertexCache[indexBuffer[i]];
+		const ClipVertex& v1 = m_vertexCache[indexBuffer[i + 1]];
+		const ClipVertex& v2 = m_vertexCache[indexBuffer[i + 2]];
+
+		// 三个顶点都在同一个平面外侧，整个三角形在视锥外
+		if (v0.outCode & v1.outCode & v2.outCode)
 		{
-			Vec3f barycentric = _getBarycentric(pVert, point);
-			if (barycentric.x < 0 || barycentric.y < 0 || barycentric.z < 0)
-				continue;
+			++m_stats.culledFrustum;
+			continue;
+		}
 
-			// 通过三角重心法插值获取到p点深度值
-			point.z = pVert[0].z * barycentric[0] + pVert[1].z * barycentric[1] + pVert[2].z * barycentric[2];
-			if (point.z < m_zBuffer[(int)(point.x + point.y * m_width)]) // 提前深度测试了
+		// 在保护带内且没有穿过近平面，不需要裁剪
+		uint32_t primitiveID = primitiveBase + (uint32_t)(i / 3);
+		int outCode = v0.outCode | v1.outCode | v2.outCode;
+		if (!(outCode & (clipNear | guardLeft | guardRight | guardBottom | guardTop)))
+		{
+			RasterTriangle triangle;
+			if (_setupTriangle(kernel, v0.output, v1.output, v2.output, triangle))
 			{
-				m_zBuffer[(int)(point.x + point.y * m_width)] = point.z; // 更新深度缓冲
+				triangle.id.primitiveID = primitiveID;
+				_submitTriangle(std::move(triangle));
+			}
+			continue;
+		}
+
+		_clipTriangle(kernel, v0, v1, v2, outCode, primitiveID);
+	}
+
+	double elapsed = elapsedMs(start, Clock::now());
+	if (bImmediate)
+		m_stats.rasterTime += elapsed;
+	else
+		m_stats.primitiveTime += elapsed;
+}
 
-				IShader::FragmentInput fragInput;
-				fragInput.pPixelVert.emplace(point); // 初始化pPixelVert
-				_interpolationAttrs(vertexOutput, fragInput, barycentric); // 插值其他属性
+void RasterEngine::_clipTriangle(const RasterPipeline::DrawKernel& kernel, const ClipVertex& v0, const ClipVertex& v1, const ClipVertex& v2, int outCode, uint32_t primitiveID)
+{
+	++m_stats.clippedTriangles;
+
+	// Sutherland-Hodgman，依次用每个相关的平面裁剪多边形
+	// 裁剪空间中属性随位置线性变化，新顶点的属性直接线性插值
+	std::vector<ClipVertex>& polygon = m_clipPolygon;
+	std::vector<ClipVertex>& clipped = m_clipScratch;
+	polygon.assign({ v0, v1, v2 });
+	for (int plane : clipPlanes)
+	{
+		if (!(outCode & plane))
+			continue;
+
+		clipped.clear();
+		for (size_t i = 0; i < polygon.size(); ++i)
+		{
+			const ClipVertex& curr = polygon[i];
+			const ClipVertex& next = polygon[(i + 1) % polygon.size()];
+			float currDist = planeDistance(curr.clipPos, plane);
+			float nextDist = planeDistance(next.clipPos, plane);
 
-				if (!m_pIShader->fragment(fragInput, color)) // 执行片段着色器，主要就是确定该像素的颜色
-					m_pDevice->set((int)(point.x), (int)(point.y), color); // 只有不被丢弃的像素才填充颜色
+			if (currDist >= 0.f)
+				clipped.push_back(curr);
+
+			// 边与平面相交，插入交点
+			if ((currDist >= 0.f) != (nextDist >= 0.f))
+			{
+				float t = currDist / (currDist - nextDist);
+				ClipVertex vertex;
+				vertex.clipPos = curr.clipPos + (next.clipPos - curr.clipPos) * t;
+				for (int k = 0; k < kernel.varyingCount; ++k)
+				{
+					vertex.output.varyings[k] = curr.output.varyings[k] + (next.output.varyings[k] - curr.output.varyings[k]) * t;
+				}
+				clipped.push_back(vertex);
 			}
 		}
+
+		std::swap(polygon, clipped);
+		if (polygon.size() < 3)
+			return;
+	}
+
+	// 裁剪后的凸多边形转到视口坐标，按扇形拆成三角形
+	for (ClipVertex& vertex : polygon)
+	{
+		vertex.output.pos = vertex.clipPos;
+		_transViewportCoords(vertex.output.pos, kernel.pIShader->m_viewportMatrix);
+	}
+
+	for (size_t i = 1; i + 1 < polygon.size(); ++i)
+	{
+		RasterTriangle triangle;
+		if (_setupTriangle(kernel, polygon[0].output, polygon[i].output, polygon[i + 1].output, triangle))
+		{
+			triangle.id.primitiveID = primitiveID; // 裁剪出的三角形都属于原来的图元
+			_submitTriangle(std::move(triangle));
+		}
 	}
 }
 
-Vec3f RasterEngine::_getBarycentric(const Vec3f* pVert, const Vec3f point)
+bool RasterEngine::_validIndices(const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count) const
 {
-	Vec3f PA = pVert[0] - point;
-	Vec3f AB = pVert[1] - pVert[0];
-	Vec3f AC = pVert[2] - pVert[0];
+	if (!indexBuffer)
+		return false;
 
-	// 通过叉乘获取重心坐标, 对应[area, u, v]，area表示面积
-	Vec3f barycentric = cross(Vec3f(PA.x, AB.x, AC.x), Vec3f(PA.y, AB.y, AC.y));
-	if ((barycentric.x - 0.f) < 1e-2)
-		return Vec3f(-1, 1, 1); // 等于0表示退化为直线，为无效的三角形
+	// 顶点缓存按索引直接寻址，每次绘制检查一遍，有越界的索引时整个绘制不执行
+	int triangleCount = count / 3;
+	for (int i = 0; i < triangleCount * 3; ++i)
+	{
+		if (indexBuffer[i] < 0 || indexBuffer[i] >= vertexStreams.count)
+			return false;
+	}
+	return true;
+}
 
-	// 转为1-u-v, u, v的标准格式，即比例模式
-	return Vec3f(1.f - (barycentric.y + barycentric.z) / barycentric.x, barycentric.y / barycentric.x, barycentric.z / barycentric.x);
+void RasterEngine::_submitTriangle(RasterTriangle&& triangle)
+{
+	++m_stats.rasterTriangles;
+	if (!m_pDepthMap && m_executeType == ExecutexType::Asynchronous)
+	{
+		_binTriangle(std::move(triangle));
+		return;
+	}
+
+	// 立即光栅化，耗时由_assembleTriangles按绘制统计
+	uint8_t coverage = RasterPipeline::CoverageNone;
+	if (m_pDepthMap)
+	{
+		// 独立的深度图不参与分块，直接光栅化
+		ScreenRect depthRect;
+		depthRect.maxX = m_pDepthMap->width() - 1;
+		depthRect.maxY = m_pDepthMap->height() - 1;
+		coverage = triangle.pRasterize(triangle, depthRect, m_pDepthMap->rasterTarget(), m_stats.raster);
+	}
+	else
+	{
+		ScreenRect screenRect;
+		screenRect.maxX = m_width - 1;
+		screenRect.maxY = m_height - 1;
+		coverage = _rasterizeTriangle(triangle, screenRect, m_stats.raster);
+	}
+
+	if (coverage == RasterPipeline::CoverageBlocks)
+		++m_stats.culledHiZ;
 }
 
-void RasterEngine::_transViewportCoords(Vec4f& vec)
+bool RasterEngine::_setupTriangle(const RasterPipeline::DrawKernel& kernel, const IShader::VertexOutput& v0, const IShader::VertexOutput& v1, const IShader::VertexOutput& v2, RasterTriangle& triangle)
 {
-	vec = vec / vec[3]; // 透视除法，转换到NDC
-	vec = m_pIShader->m_viewportMatrix * vec; // 转到视口坐标
+	const Vec4f& p0 = v0.pos;
+	const Vec4f& p1 = v1.pos;
+	const Vec4f& p2 = v2.pos;
 
-	_transAccuracy(vec); // 处理下精度问题
+	// 顶点已经对齐到亚像素，转换为定点坐标后的计算都是精确的
+	using RasterPipeline::subpixelScale;
+	using RasterPipeline::subpixelBits;
+	auto toFixed = [](float v) { return (int64_t)std::llround(v * subpixelScale); };
+	int64_t x0 = toFixed(p0[0]), y0 = toFixed(p0[1]);
+	int64_t x1 = toFixed(p1[0]), y1 = toFixed(p1[1]);
+	int64_t x2 = toFixed(p2[0]), y2 = toFixed(p2[1]);
+
+	// 背面与零面积剔除：面积为0表示退化为直线，面积为负表示顺时针（背面），都不需要绘制
+	int64_t area = (x1 - x0) * (y2 - y0) - (x2 - x0) * (y1 - y0);
+	if (area <= 0)
+	{
+		++m_stats.culledBackface;
+		return false;
+	}
+
+	triangle.pIShader = kernel.pIShader;
+	triangle.pRasterize = kernel.pRasterize;
+	// 延迟着色时画到渲染目标的着色绘制改为几何阶段，只写深度的绘制不变
+	if (m_bDeferred && !m_pDepthMap && !kernel.depthOnly && kernel.pRasterizeGeometry)
+	{
+		triangle.pRasterize = kernel.pRasterizeGeometry;
+		triangle.lightingIndex = m_lightingIndex;
+	}
+	// 面积换算到像素单位
+	triangle.invArea = (float)(subpixelScale * subpixelScale) / (float)area;
+
+	// 计算包围盒，即左上和右下，只包含采样点（像素的整数坐标），可能落在保护带内的屏幕外区域，需要与屏幕求交
+	ScreenRect& bound = triangle.bound;
+	bound.minX = std::max((int)-((-std::min({ x0, x1, x2 })) >> subpixelBits), 0);
+	bound.minY = std::max((int)-((-std::min({ y0, y1, y2 })) >> subpixelBits), 0);
+	int targetWidth = m_pDepthMap ? m_pDepthMap->width() : m_width;
+	int targetHeight = m_pDepthMap ? m_pDepthMap->height() : m_height;
+	bound.maxX = std::min((int)(std::max({ x0, x1, x2 }) >> subpixelBits), targetWidth - 1);
+	bound.maxY = std::min((int)(std::max({ y0, y1, y2 }) >> subpixelBits), targetHeight - 1);
+	if (bound.minX > bound.maxX || bound.minY > bound.maxY)
+	{
+		++m_stats.culledOffscreen;
+		return false;
+	}
+
+	// 建立三条边的定点边函数，覆盖测试只用整数，结果是精确的
+	// 填充规则（左上规则）：采样点正好落在边上时，只有左边与上边算作覆盖，共享边的像素只会被其中一个三角形绘制
+	// 光栅化的y轴向上，逆时针三角形的左边A > 0，上边A == 0且B < 0，其余的边要求E > 0，即把C减1
+	auto setupEdge = [](int64_t ax, int64_t ay, int64_t bx, int64_t by, FixedEdge& fixedEdge, EdgeFunction& edge)
+		{
+			fixedEdge.A = ay - by;
+			fixedEdge.B = bx - ax;
+			fixedEdge.C = ax * by - bx * ay;
+
+			// 插值使用的浮点边函数换算到像素单位，不含填充规则的偏移
+			edge.A = (float)fixedEdge.A / subpixelScale;
+			edge.B = (float)fixedEdge.B / subpixelScale;
+			edge.C = (float)fixedEdge.C / (subpixelScale * subpixelScale);
+
+			bool bTopLeft = fixedEdge.A > 0 || (fixedEdge.A == 0 && fixedEdge.B < 0);
+			if (!bTopLeft)
+				fixedEdge.C -= 1;
+		};
+
+	setupEdge(x1, y1, x2, y2, triangle.fixedEdges[0], triangle.edges[0]);
+	setupEdge(x2, y2, x0, y0, triangle.fixedEdges[1], triangle.edges[1]);
+	setupEdge(x0, y0, x1, y1, triangle.fixedEdges[2], triangle.edges[2]);
+
+	auto setupPlane = [](float a0, float a1, float a2, AttrPlane& plane)
+		{
+			plane.base = a0;
+			plane.d1 = a1 - a0;
+			plane.d2 = a2 - a0;
+		};
+
+	// 深度在屏幕空间是线性的，直接插值
+	setupPlane(p0[2], p1[2], p2[2], triangle.depth);
+	triangle.minDepth = std::min({ p0[2], p1[2], p2[2] });
+	triangle.maxDepth = std::max({ p0[2], p1[2], p2[2] });
+	triangle.depthTest = kernel.depthOnly ? RasterPipeline::DepthTest::Less : m_depthTest;
+	triangle.id.drawID = m_drawID;
+	triangle.pQuerySamples = m_activeQuery >= 0 ? &m_querySamples[m_activeQuery] : nullptr;
+
+	// 属性除以w之后在屏幕空间是线性的，插值后再乘以w还原（透视校正）
+	setupPlane(p0[3], p1[3], p2[3], triangle.invW);
+	triangle.varyingCount = kernel.varyingCount;
+	triangle.useDerivatives = kernel.useDerivatives;
+	for (int i = 0; i < triangle.varyingCount; ++i)
+	{
+		setupPlane(v0.varyings[i] * p0[3], v1.varyings[i] * p1[3], v2.varyings[i] * p2[3], triangle.varyings[i]);
+	}
+
+	return true;
 }
 
-void RasterEngine::_transAccuracy(Vec4f& vec)
+uint8_t RasterEngine::_rasterizeTriangle(const RasterTriangle& triangle, const ScreenRect& clipRect, RasterPipeline::RasterStats& stats)
 {
-	vec[0] = std::round(vec[0]);
-	vec[1] = std::round(vec[1]);
+	RasterPipeline::RasterTarget target = m_renderTarget.rasterTarget();
 
-	vec[0] = std::clamp(vec[0], 0.f, (float)m_width - 1.f);
-	vec[1] = std::clamp(vec[1], 0.f, (float)m_height - 1.f);
-	vec[2] = std::clamp(vec[2], 0.f, 1.f);
+	// 光栅化循环按着色器类型实例化，见rasterpipeline.h
+	return triangle.pRasterize(triangle, clipRect, target, stats);
 }
 
-IShader::VertexOutput RasterEngine::_executeVertex(const IShader::VertexInput& input)
+void RasterEngine::_binTriangle(RasterTriangle&& triangle)
 {
-	IShader::VertexOutput vertexOutput = m_pIShader->vertex(input);
-	if (vertexOutput.pPos.has_value())
+	// 按包围盒把三角形分配到覆盖的分块中
+	int triIndex = (int)m_triangles.size();
+	int minCol = triangle.bound.minX / tileSize;
+	int minRow = triangle.bound.minY / tileSize;
+	int maxCol = triangle.bound.maxX / tileSize;
+	int maxRow = triangle.bound.maxY / tileSize;
+	for (int row = minRow; row <= maxRow; ++row)
 	{
-		std::for_each(vertexOutput.pPos.value().begin(), vertexOutput.pPos.value().end(), [this](Vec4f& vec)
-			{
-				_transViewportCoords(vec); // 执行透视除法并转换到视口坐标
-			});
+		for (int col = minCol; col <= maxCol; ++col)
+		{
+			m_tileBins[col + row * m_tileCols].push_back(triIndex);
+		}
 	}
 
-	return vertexOutput;
+	m_triangles.push_back(std::move(triangle));
 }
 
-void RasterEngine::_interpolationAttrs(IShader::VertexOutput& vertexOutput, IShader::FragmentInput& fragInput, const Vec3f& barycentric)
+void RasterEngine::_resetTiles()
 {
-	if (vertexOutput.pTexCoord)
+	m_triangles.clear();
+	m_tileBins.resize(m_tileCols * m_tileRows);
+	m_tileCoverage.resize(m_tileCols * m_tileRows);
+	for (auto& bin : m_tileBins)
 	{
-		// 插值获取到纹理坐标
-		Vec2f* uv = vertexOutput.pTexCoord.value().data();
-		Vec2f pixelUV = uv[0] * barycentric[0] + uv[1] * barycentric[1] + uv[2] * barycentric[2];
+		bin.clear();
+	}
+}
+
+bool RasterEngine::_clipLine(const ClipVertex& v0, const ClipVertex& v1, const Matrix& viewportMatrix, RasterPipeline::ScreenLine& line)
+{
+	// 两个端点在同一个平面外侧，整条线段在视锥外
+	if (v0.outCode & v1.outCode)
+		return false;
 
-		if (!fragInput.pPixeUV)
-			fragInput.pPixeUV.emplace(pixelUV);
+	// 穿过近平面的端点先在齐次空间裁剪，之后才能做透视除法
+	Vec4f p0 = v0.output.pos;
+	Vec4f p1 = v1.output.pos;
+	if ((v0.outCode | v1.outCode) & clipNear)
+	{
+		float d0 = planeDistance(v0.clipPos, clipNear);
+		float d1 = planeDistance(v1.clipPos, clipNear);
+		Vec4f pos = v0.clipPos + (v1.clipPos - v0.clipPos) * (d0 / (d0 - d1));
+		_transViewportCoords(pos, viewportMatrix);
+		(v0.outCode & clipNear ? p0 : p1) = pos;
 	}
 
-	if (vertexOutput.pNorm)
+	// Liang-Barsky，裁剪到视口（像素中心向外半个像素）内，保留t0到t1之间的部分
+	float t0 = 0.f;
+	float t1 = 1.f;
+	auto clipAxis = [&](float p, float q)
+		{
+			// 要求 p * t <= q
+			if (p == 0.f)
+				return q >= 0.f;
+
+			float t = q / p;
+			if (p < 0.f)
+				t0 = std::max(t0, t);
+			else
+				t1 = std::min(t1, t);
+			return t0 <= t1;
+		};
+
+	float dx = p1[0] - p0[0];
+	float dy = p1[1] - p0[1];
+	if (!clipAxis(-dx, p0[0] + 0.5f) || !clipAxis(dx, m_width - 0.5f - p0[0]) || !clipAxis(-dy, p0[1] + 0.5f) || !clipAxis(dy, m_height - 0.5f - p0[1]))
+		return false;
+
+	// 视口坐标下深度是线性的，端点的深度直接插值
+	Vec3f start(p0[0], p0[1], p0[2]);
+	Vec3f delta(dx, dy, p1[2] - p0[2]);
+	line.p0 = start + delta * t0;
+	line.p1 = start + delta * t1;
+	line.minY = std::clamp((int)std::floor(std::min(line.p0.y, line.p1.y) + 0.5f), 0, m_height - 1);
+	line.maxY = std::clamp((int)std::floor(std::max(line.p0.y, line.p1.y) + 0.5f), 0, m_height - 1);
+	return true;
+}
+
+void RasterEngine::_rasterizeLines(const TGAColor& color, bool bDepthTest)
+{
+	Clock::time_point start = Clock::now();
+	RasterPipeline::RasterTarget target = m_renderTarget.rasterTarget();
+	ScreenRect screenRect;
+	screenRect.maxX = m_width - 1;
+	screenRect.maxY = m_height - 1;
+
+	if (m_executeType == ExecutexType::Synchronous)
 	{
-		// 插值获取到法线坐标
-		Vec3f* norm = vertexOutput.pNorm.value().data();
-		Vec3f pixelNorm = norm[0] * barycentric[0] + norm[1] * barycentric[1] + norm[2] * barycentric[2];
+		for (const RasterPipeline::ScreenLine& line : m_lines)
+			RasterPipeline::rasterizeLine(line, screenRect, target, color, bDepthTest);
 
-		if (!fragInput.pPixeNorm)
-			fragInput.pPixeNorm.emplace(pixelNorm);
+		m_stats.rasterTime += elapsedMs(start, Clock::now());
+		return;
 	}
 
-	if (vertexOutput.pTangent)
+	// 按分块的行划分横条，线段分配到经过的每个横条，各横条只写自己的行，互不重叠
+	m_lineBins.resize(m_tileRows);
+	for (auto& bin : m_lineBins)
+	{
+		bin.clear();
+	}
+	for (int lineIndex = 0; lineIndex < (int)m_lines.size(); ++lineIndex)
 	{
-		// 插值切线与副切线
-		auto& [tangent, bitangent] = vertexOutput.pTangent.value();
-		tangent = tangent * barycentric[0] + tangent * barycentric[1] + tangent * barycentric[2];
-		bitangent = bitangent * barycentric[0] + bitangent * barycentric[1] + bitangent * barycentric[2];
+		const RasterPipeline::ScreenLine& line = m_lines[lineIndex];
+		for (int row = line.minY / tileSize; row <= line.maxY / tileSize; ++row)
+		{
+			m_lineBins[row].push_back(lineIndex);
+		}
+	}
+
+	ThreadPool& threadPool = ThreadPool::instance();
+	std::vector<std::future<void>> taskFutures;
+	for (int row = 0; row < m_tileRows; ++row)
+	{
+		if (m_lineBins[row].empty())
+			continue;
+
+		auto future = threadPool.commit([this, row, screenRect, &target, &color, bDepthTest]
+			{
+				ScreenRect bandRect = screenRect;
+				bandRect.minY = row * tileSize;
+				bandRect.maxY = std::min(bandRect.minY + tileSize, m_height) - 1;
+				for (int lineIndex : m_lineBins[row])
+					RasterPipeline::rasterizeLine(m_lines[lineIndex], bandRect, target, color, bDepthTest);
+			});
+
+		taskFutures.push_back(std::move(future));
+	}
 
-		if (!fragInput.pPixelTangent)
-			fragInput.pPixelTangent.emplace(tangent, bitangent);
+	// 等待所有横条完成
+	for (auto& future : taskFutures)
+	{
+		future.get();
 	}
+	m_stats.rasterTime += elapsedMs(start, Clock::now());
 }
 
+void RasterEngine::_transViewportCoords(Vec4f& vec, const Matrix& viewportMatrix)
+{
+	float invW = 1.f / vec[3];
+	vec = vec * invW; // 透视除法，转换到NDC
+	vec = viewportMatrix * vec; // 转到视口坐标
+
+	_transAccuracy(vec); // 处理下精度问题
+	vec[3] = invW; // 保留1/w，用于透视校正插值
+}
+
+void RasterEngine::_transAccuracy(Vec4f& vec)
+{
+	// 对齐到亚像素，之后转换为定点坐标，屏幕外的部分由裁剪与包围盒求交处理，不再限制到视口内
+	constexpr float scale = (float)RasterPipeline::subpixelScale;
+	vec[0] = std::round(vec[0] * scale) / scale;
+	vec[1] = std::round(vec[1] * scale) / scale;
+}
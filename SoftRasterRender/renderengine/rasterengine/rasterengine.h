@@ -2,6 +2,9 @@
 #define __RASTERENGINE_H__
 
 #include "irenderengine.h"
+#include "rendertarget.h"
+#include <vector>
+#include <deque>
 
 class TGAImage;
 
@@ -26,28 +29,143 @@ public:
     // 设置着色器
     virtual void setShader(IShader* pIShader) override;
 
+    // 设置深度测试的方式
+    virtual void setDepthTest(const RasterPipeline::DepthTest depthTest) override;
+
+    // 设置渲染目标的颜色格式，下次setDevice时生效
+    virtual void setColorFormat(const RasterPipeline::ColorFormat format) override;
+
+    // 设置着色方式，下次setDevice时生效
+    virtual void setShadingMode(const RasterPipeline::ShadingMode mode) override;
+
+    // 设置执行方式，并行模式下按分块光栅化
+    virtual void setExecuteType(const ExecutexType type) override;
+    virtual void flush() override;
+
+    // 上一帧的流水线统计
+    virtual RasterPipeline::PipelineStats getPipelineStats() const override;
+
+    // 可见性缓冲
+    virtual void setVisibilityBuffer(bool bEnable) override;
+    virtual void setDrawID(uint32_t drawID) override;
+    virtual RasterPipeline::VisibilityBuffer getVisibilityBuffer() override;
+
+    // 遮挡查询
+    virtual void beginQuery(int query) override;
+    virtual void endQuery() override;
+    virtual int64_t getQueryResult(int query) override;
+
     // Bresenham 线段算法
     virtual void drawLine(Vec2i start, Vec2i end, TGAColor color) override;
     virtual void drawLine(int x0, int y0, int x1, int y1, TGAColor color) override;
 
+    // 批量线框，共享的边只绘制一次，按横条并行光栅化
+    virtual void drawWireframe(const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count, TGAColor color, bool bDepthTest = false) override;
+
     // 扫线算法填充三角形
     virtual void drawTriangle(Vec3f v0, Vec3f v1, Vec3f v2, TGAColor color) override;
     // 重心算法填充三角形
     virtual void drawTriangle(const IShader::VertexInput& input) override;
+    // 索引绘制，带变换后顶点缓存
+    virtual void drawIndexed(const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count) override;
+
+    // 只写深度的绘制，用于深度预渲染与阴影图
+    virtual void drawDepth(const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count, DepthMap* pDepthMap = nullptr) override;
+
+    // 实例化绘制，共享顶点数据，所有实例一起进入分块
+    virtual void drawIndexedInstanced(const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count, const IShader::InstanceData* pInstances, int instanceCount) override;
+    virtual void drawDepthInstanced(const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count, const IShader::InstanceData* pInstances, int instanceCount, DepthMap* pDepthMap = nullptr) override;
+
+    virtual void drawIndexed(const RasterPipeline::DrawKernel& kernel, const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count) override;
+    virtual void drawIndexedInstanced(const RasterPipeline::DrawKernel& kernel, const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count, const IShader::InstanceData* pInstances, int instanceCount) override;
+    using IRasterRenderEngin::drawIndexed;
+    using IRasterRenderEngin::drawIndexedInstanced;
 
 private:
-    Vec3f _getBarycentric(const Vec3f* pVert, const Vec3f point); // 判断是否在三角形中
-    void _transViewportCoords(Vec4f& vec);
-    void _transAccuracy(Vec4f& vec);
+    using ScreenRect = RasterPipeline::ScreenRect;
+    using EdgeFunction = RasterPipeline::EdgeFunction;
+    using FixedEdge = RasterPipeline::FixedEdge;
+    using AttrPlane = RasterPipeline::AttrPlane;
+    using RasterTriangle = RasterPipeline::RasterTriangle;
+
+    // 顶点着色后的顶点，保留裁剪空间位置用于裁剪
+    struct ClipVertex
+    {
+        Vec4f clipPos; // 裁剪空间位置
+        int outCode = 0; // 在哪些平面的外侧
+        IShader::VertexOutput output; // 视口坐标与插值属性，穿过近平面的顶点没有视口坐标
+    };
+
+    // 延迟着色的光照阶段用到的着色器
+    struct LightingKernel
+    {
+        IShader* pIShader = nullptr;
+        RasterPipeline::LightingFunc pLighting = nullptr;
+    };
+
+    bool _validIndices(const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count) const;
+    void _beginDraw(const RasterPipeline::DrawKernel& kernel);
+    RasterPipeline::DrawKernel _depthKernel() const;
+    void _shadeVertices(const RasterPipeline::DrawKernel& kernel, const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count);
+    void _assembleTriangles(const RasterPipeline::DrawKernel& kernel, const IShader::VertexStreams& vertexStreams, const int* indexBuffer, int count, uint32_t primitiveBase);
+    void _clipTriangle(const RasterPipeline::DrawKernel& kernel, const ClipVertex& v0, const ClipVertex& v1, const ClipVertex& v2, int outCode, uint32_t primitiveID);
+    void _submitTriangle(RasterTriangle&& triangle);
+    bool _setupTriangle(const RasterPipeline::DrawKernel& kernel, const IShader::VertexOutput& v0, const IShader::VertexOutput& v1, const IShader::VertexOutput& v2, RasterTriangle& triangle);
+    uint8_t _rasterizeTriangle(const RasterTriangle& triangle, const ScreenRect& clipRect, RasterPipeline::RasterStats& stats);
+    void _binTriangle(RasterTriangle&& triangle);
+    void _flushTiles();
+    void _lightingPass();
+    int64_t _lightTile(const ScreenRect& rect, const RasterPipeline::RasterTarget& target);
+    void _resetTiles();
+    bool _clipLine(const ClipVertex& v0, const ClipVertex& v1, const Matrix& viewportMatrix, RasterPipeline::ScreenLine& line);
+    void _rasterizeLines(const TGAColor& color, bool bDepthTest);
 
-    IShader::VertexOutput _executeVertex(const IShader::VertexInput& input);
-    void _interpolationAttrs(IShader::VertexOutput& vertexOutput, IShader::FragmentInput& fragInput, const Vec3f& barycentric);
+    void _transViewportCoords(Vec4f& vec, const Matrix& viewportMatrix);
+    void _transAccuracy(Vec4f& vec);
 
 private:
     int m_width = 0;
     int m_height = 0;
     TGAImage* m_pDevice = nullptr;
     IShader* m_pIShader = nullptr;
-    std::unique_ptr<float[]> m_zBuffer; // 存储深度值
+    // 颜色与深度（含层次深度缓冲）都在渲染目标中，flush时转换到设备
+    RasterPipeline::ColorFormat m_colorFormat = RasterPipeline::ColorFormat::RGBA8;
+    RenderTarget m_renderTarget;
+    RasterPipeline::DepthTest m_depthTest = RasterPipeline::DepthTest::Less;
+    RasterPipeline::ShadingMode m_shadingMode = RasterPipeline::ShadingMode::Forward;
+    bool m_bDeferred = false; // 当前渲染目标是否按延迟着色绘制
+    std::vector<LightingKernel> m_lightingKernels; // 这一帧绘制用过的着色器，G-buffer中记录其下标
+    uint32_t m_lightingIndex = 0; // 当前绘制的着色器的下标
+    DepthMap* m_pDepthMap = nullptr; // 不为空时表示正在向独立的深度图绘制
+    RasterPipeline::PipelineStats m_stats; // 当前帧正在累计的统计
+    RasterPipeline::PipelineStats m_frameStats; // 上一次flush完成的一帧的统计
+    bool m_bVisibility = false;
+    uint32_t m_drawID = 0;
+
+    // 遮挡查询的计数，deque扩充时已有元素的地址不变，缓存的三角形可以一直持有
+    std::deque<std::atomic<int64_t>> m_querySamples;
+    int m_activeQuery = -1;
+
+    // 索引绘制的变换后顶点缓存
+    // 缓存项记录写入时的批次号，与当前批次号相同才有效，换实例时只需递增批次号
+    std::vector<ClipVertex> m_vertexCache;
+    std::vector<uint32_t> m_vertexBatch;
+    uint32_t m_batch = 0;
+    std::vector<ClipVertex> m_clipPolygon; // 裁剪用的临时多边形，复用避免每次分配
+    std::vector<ClipVertex> m_clipScratch;
+
+    // 分块并行光栅化
+    ExecutexType m_executeType = ExecutexType::Synchronous;
+    int m_tileCols = 0;
+    int m_tileRows = 0;
+    std::vector<RasterTriangle> m_triangles; // 当前帧缓存的三角形，按提交顺序存放
+    std::vector<std::vector<int>> m_tileBins; // 每个分块覆盖到的三角形索引，保持提交顺序
+    std::vector<std::vector<uint8_t>> m_tileCoverage; // 与m_tileBins对应，每个三角形在该分块中的光栅化结果
+    std::vector<uint8_t> m_triangleCoverage; // 合并各分块后每个三角形的光栅化结果
+
+    // 批量线框，复用避免每次分配
+    std::vector<uint64_t> m_edgeKeys; // 去重用的边，两个端点的索引按大小拼成一个键
+    std::vector<RasterPipeline::ScreenLine> m_lines;
+    std::vector<std::vector<int>> m_lineBins; // 每个横条（一行分块）经过的线段索引
 };
 #endif // !__RASTERENGINE_H__
@@ -0,0 +1,267 @@
+﻿#include "stdafx.h"
+#include "simd.h"
+#include "rendertarget.h"
+
+// 支持AVX的处理器都支持SSSE3的字节重排
+#if defined(SIMD_AVX)
+#define SIMD_SSSE3
+#endif
+
+namespace
+{
+	// 行与缓冲区的对齐（字节）
+	constexpr size_t alignment = 32;
+	constexpr int alignPixels = alignment / sizeof(float);
+
+	uint32_t packColor(const TGAColor& color)
+	{
+		uint32_t packed;
+		std::memcpy(&packed, color.m_bgra, sizeof(packed));
+		return packed;
+	}
+
+	// 把一段32位的值写满，按向量写入，count为向量宽度的整数倍
+	void fillBits(float* pDst, size_t count, uint32_t bits)
+	{
+		float value;
+		std::memcpy(&value, &bits, sizeof(value));
+		vfloat v(value);
+		for (size_t i = 0; i < count; i += vfloat::size)
+		{
+			v.storeAligned(pDst + i);
+		}
+	}
+
+	// 把一行RGBA32F转换成RGBA8
+	void convertRow(const float* pSrc, uint32_t* pDst, int count)
+	{
+		int i = 0;
+#if defined(SIMD_SSE)
+		const __m128 scale = _mm_set1_ps(255.f);
+		const __m128 half = _mm_set1_ps(0.5f);
+		for (; i + 4 <= count; i += 4)
+		{
+			// 每个像素的4个分量正好一个向量，缩放后加0.5截断取整（与标量部分相同），饱和压缩到8位
+			__m128i c0 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_load_ps(pSrc + i * 4), scale), half));
+			__m128i c1 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_load_ps(pSrc + i * 4 + 4), scale), half));
+			__m128i c2 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_load_ps(pSrc + i * 4 + 8), scale), half));
+			__m128i c3 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_load_ps(pSrc + i * 4 + 12), scale), half));
+			__m128i packed = _mm_packus_epi16(_mm_packs_epi32(c0, c1), _mm_packs_epi32(c2, c3));
+			_mm_storeu_si128((__m128i*)(pDst + i), packed);
+		}
+#endif
+		for (; i < count; ++i)
+		{
+			uint32_t packed = 0;
+			for (int c = 0; c < 4; ++c)
+			{
+				int value = (int)(std::clamp(pSrc[i * 4 + c], 0.f, 1.f) * 255.f + 0.5f);
+				packed |= (uint32_t)value << (c * 8);
+			}
+			pDst[i] = packed;
+		}
+	}
+
+	// 把一行RGBA8写成TGAImage的像素格式
+	void resolveRow(const uint32_t* pSrc, unsigned char* pDst, int count, int bytespp)
+	{
+		if (bytespp == 4)
+		{
+			std::memcpy(pDst, pSrc, count * sizeof(uint32_t));
+			return;
+		}
+
+		int i = 0;
+#if defined(SIMD_SSSE3)
+		if (bytespp == 3)
+		{
+			// 每次4个像素去掉alpha得到12字节，写16字节，多写的4字节由下一次覆盖，最后一组留给标量处理
+			const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+			for (; i + 6 <= count; i += 4)
+			{
+				__m128i pixels = _mm_loadu_si128((const __m128i*)(pSrc + i));
+				_mm_storeu_si128((__m128i*)(pDst + i * 3), _mm_shuffle_epi8(pixels, shuffle));
+			}
+		}
+#endif
+		for (; i < count; ++i)
+		{
+			std::memcpy(pDst + i * bytespp, pSrc + i, bytespp);
+		}
+	}
+}
+
+void RenderTarget::AlignedDeleter::operator()(void* p) const
+{
+	::operator delete[](p, std::align_val_t(alignment));
+}
+
+template<class T>
+RenderTarget::AlignedBuffer<T> RenderTarget::_allocate(size_t count)
+{
+	return AlignedBuffer<T>(static_cast<T*>(::operator new[](count * sizeof(T), std::align_val_t(alignment))));
+}
+
+void RenderTarget::resize(int width, int height, RasterPipeline::ColorFormat format, int optionalPlanes)
+{
+	if (width == m_width && height == m_height && format == m_format && optionalPlanes == m_optionalPlanes && m_depth)
+		return;
+
+	m_width = width;
+	m_height = height;
+	m_format = format;
+	m_optionalPlanes = optionalPlanes;
+	m_stride = (width + alignPixels - 1) / alignPixels * alignPixels;
+
+	// 最后一行之后再留一个向量宽度，行尾按向量读取时不会越界
+	size_t pixelCount = (size_t)m_stride * height + alignPixels;
+	m_depth = _allocate<float>(pixelCount);
+	m_overdraw = _allocate<uint8_t>(pixelCount);
+	m_color8.reset();
+	m_colorF.reset();
+	if (format == RasterPipeline::ColorFormat::RGBA8)
+		m_color8 = _allocate<uint32_t>(pixelCount);
+	else
+		m_colorF = _allocate<float>(pixelCount * 4);
+	m_visibility.reset();
+	m_surface.reset();
+	if (optionalPlanes & VisibilityPlane)
+		m_visibility = _allocate<RasterPipeline::VisibilitySample>(pixelCount);
+	if (optionalPlanes & SurfacePlane)
+		m_surface = _allocate<IShader::SurfaceData>(pixelCount);
+
+	m_hizCols = (width + RasterPipeline::hizBlockSize - 1) / RasterPipeline::hizBlockSize;
+	m_hizRows = (height + RasterPipeline::hizBlockSize - 1) / RasterPipeline::hizBlockSize;
+	m_hizMin = std::make_unique<float[]>(m_hizCols * m_hizRows);
+	m_hizMax = std::make_unique<float[]>(m_hizCols * m_hizRows);
+}
+
+void RenderTarget::clear(const TGAColor& color, float depth)
+{
+	if (!m_depth)
+		return;
+
+	size_t pixelCount = (size_t)m_stride * m_height + alignPixels;
+	uint32_t depthBits;
+	std::memcpy(&depthBits, &depth, sizeof(depthBits));
+	fillBits(m_depth.get(), pixelCount, depthBits);
+	std::memset(m_overdraw.get(), 0, pixelCount);
+
+	if (m_color8)
+	{
+		fillBits(reinterpret_cast<float*>(m_color8.get()), pixelCount, packColor(color));
+	}
+	else
+	{
+		// 向量宽度是4的倍数，一个向量装下整数个像素，重复写入同一个向量
+		static_assert(vfloat::size % 4 == 0, "vector must hold whole pixels");
+		alignas(alignment) float bgra[vfloat::size];
+		for (int i = 0; i < vfloat::size; ++i)
+		{
+			bgra[i] = color.m_bgra[i % 4] / 255.f;
+		}
+
+		vfloat v = vfloat::loadAligned(bgra);
+		float* pColor = m_colorF.get();
+		for (size_t i = 0; i < pixelCount * 4; i += vfloat::size)
+		{
+			v.storeAligned(pColor + i);
+		}
+	}
+
+	if (m_visibility)
+		std::fill_n(m_visibility.get(), pixelCount, RasterPipeline::VisibilitySample());
+	if (m_surface)
+		std::fill_n(m_surface.get(), pixelCount, IShader::SurfaceData());
+
+	std::fill_n(m_hizMin.get(), m_hizCols * m_hizRows, depth);
+	std::fill_n(m_hizMax.get(), m_hizCols * m_hizRows, depth);
+}
+
+void RenderTarget::setColor(int x, int y, const TGAColor& color)
+{
+	if (x < 0 || x >= m_width || y < 0 || y >= m_height)
+		return;
+
+	RasterPipeline::writeColor(rasterTarget(), x, y, color);
+}
+
+void RenderTarget::resolve(TGAImage* pDevice) const
+{
+	unsigned char* pPixels = pDevice ? pDevice->pixels() : nullptr;
+	if (!pPixels || !m_depth)
+		return;
+
+	int width = std::min(m_width, pDevice->get_width());
+	int height = std::min(m_height, pDevice->get_height());
+	int bytespp = pDevice->get_bytespp();
+
+	// 浮点格式先逐行转换到8位
+	std::vector<uint32_t> convertedRow(m_colorF ? m_stride : 0);
+	for (int y = 0; y < height; ++y)
+	{
+		const uint32_t* pRow = nullptr;
+		if (m_color8)
+		{
+			pRow = m_color8.get() + (size_t)y * m_stride;
+		}
+		else
+		{
+			convertRow(m_colorF.get() + (size_t)y * m_stride * 4, convertedRow.data(), width);
+			pRow = convertedRow.data();
+		}
+
+		resolveRow(pRow, pPixels + (size_t)y * pDevice->get_width() * bytespp, width, bytespp);
+	}
+}
+
+RasterPipeline::RasterTarget RenderTarget::rasterTarget()
+{
+	RasterPipeline::RasterTarget target;
+	target.pColor8 = m_color8.get();
+	target.pColorF = m_colorF.get();
+	target.pZBuffer = m_depth.get();
+	target.width = m_width;
+	target.height = m_height;
+	target.stride = m_stride;
+	target.pHiZMin = m_hizMin.get();
+	target.pHiZMax = m_hizMax.get();
+	target.hizCols = m_hizCols;
+	target.pOverdraw = m_overdraw.get();
+	target.pVisibility = m_visibility.get();
+	target.pSurface = m_surface.get();
+	return target;
+}
+
+void RenderTarget::collectOverdraw(int64_t* pBins, int binCount)
+{
+	if (!m_overdraw || binCount <= 0)
+		return;
+
+	// 先按次数统计，再归并到直方图，行尾的填充不参与
+	int64_t counts[256] = {};
+	for (int y = 0; y < m_height; ++y)
+	{
+		uint8_t* pRow = m_overdraw.get() + (size_t)y * m_stride;
+		for (int x = 0; x < m_width; ++x)
+		{
+			++counts[pRow[x]];
+		}
+		std::memset(pRow, 0, m_width);
+	}
+
+	for (int i = 0; i < 256; ++i)
+	{
+		pBins[std::min(i, binCount - 1)] += counts[i];
+	}
+}
+
+RasterPipeline::VisibilityBuffer RenderTarget::visibilityBuffer() const
+{
+	RasterPipeline::VisibilityBuffer buffer;
+	buffer.pSamples = m_visibility.get();
+	buffer.width = m_width;
+	buffer.height = m_height;
+	buffer.stride = m_stride;
+	return buffer;
+}
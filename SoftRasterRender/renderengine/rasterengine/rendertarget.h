@@ -0,0 +1,79 @@
+﻿#ifndef __RENDERTARGET_H__
+#define __RENDERTARGET_H__
+
+#include "rasterpipeline.h"
+
+// 光栅化的渲染目标，颜色与深度分开存放
+// 每行按32字节对齐，行尾留有填充，光栅化按向量读写时不需要处理越界
+// 一帧绘制结束后通过resolve一次性转换到TGAImage，绘制过程中不经过TGAImage的逐像素接口
+class RenderTarget
+{
+public:
+    RenderTarget() = default;
+    ~RenderTarget() = default;
+
+    // 颜色与深度之外，按需分配的平面
+    enum OptionalPlane : int
+    {
+        VisibilityPlane = 1 << 0, // 可见性缓冲
+        SurfacePlane = 1 << 1 // 延迟着色的G-buffer
+    };
+
+    // 尺寸、格式与可选平面都不变时复用已有的内存，optionalPlanes为OptionalPlane的组合
+    void resize(int width, int height, RasterPipeline::ColorFormat format, int optionalPlanes);
+
+    // 清空颜色、深度、可见性、G-buffer，以及层次深度缓冲
+    void clear(const TGAColor& color, float depth);
+
+    // 逐像素写颜色，只给画线等非热点路径使用
+    void setColor(int x, int y, const TGAColor& color);
+
+    // 转换并写入到TGAImage，尺寸取两者的交集
+    void resolve(TGAImage* pDevice) const;
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+
+    // 把每个像素通过深度测试的次数统计成直方图（最后一项包含更多的次数），之后计数清零
+    void collectOverdraw(int64_t* pBins, int binCount);
+
+    // 可见性缓冲的只读视图，没有开启时pSamples为空
+    RasterPipeline::VisibilityBuffer visibilityBuffer() const;
+
+    // 供光栅化循环直接读写的各平面
+    RasterPipeline::RasterTarget rasterTarget();
+
+private:
+    struct AlignedDeleter
+    {
+        void operator()(void* p) const;
+    };
+
+    template<class T>
+    using AlignedBuffer = std::unique_ptr<T[], AlignedDeleter>;
+
+    template<class T>
+    static AlignedBuffer<T> _allocate(size_t count);
+
+private:
+    int m_width = 0;
+    int m_height = 0;
+    int m_stride = 0; // 每行的像素个数，含填充
+    RasterPipeline::ColorFormat m_format = RasterPipeline::ColorFormat::RGBA8;
+
+    AlignedBuffer<uint32_t> m_color8; // RGBA8，字节顺序与TGAColor一致（bgra）
+    AlignedBuffer<float> m_colorF; // RGBA32F，每个像素4个float，顺序同上，范围[0, 1]
+    AlignedBuffer<float> m_depth;
+    AlignedBuffer<uint8_t> m_overdraw; // 每个像素通过深度测试的次数
+    int m_optionalPlanes = 0;
+    AlignedBuffer<RasterPipeline::VisibilitySample> m_visibility; // 可见性缓冲，选择性开启
+    AlignedBuffer<IShader::SurfaceData> m_surface; // G-buffer，延迟着色时才有
+
+    // 层次深度缓冲，每块的深度最小、最大值
+    int m_hizCols = 0;
+    int m_hizRows = 0;
+    std::unique_ptr<float[]> m_hizMin;
+    std::unique_ptr<float[]> m_hizMax;
+};
+
+#endif // !__RENDERTARGET_H__
@@ -0,0 +1,47 @@
+﻿#include "stdafx.h"
+#include "accumulationbuffer.h"
+
+namespace
+{
+	// ACES电影曲线的拟合（Narkowicz 2015），把[0, +inf)压缩到[0, 1)，高光平滑地饱和
+	float toneMapACES(float x)
+	{
+		return std::clamp((x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f), 0.f, 1.f);
+	}
+
+	// 线性颜色编码为sRGB
+	float linearToSRGB(float x)
+	{
+		return x <= 0.0031308f ? 12.92f * x : 1.055f * std::pow(x, 1.f / 2.4f) - 0.055f;
+	}
+}
+
+void AccumulationBuffer::resize(int width, int height)
+{
+	m_width = width;
+	m_height = height;
+	m_pixels.assign((size_t)width * height, Pixel());
+}
+
+void AccumulationBuffer::clear()
+{
+	std::fill(m_pixels.begin(), m_pixels.end(), Pixel());
+}
+
+void AccumulationBuffer::resolve(TGAImage* image, float exposure) const
+{
+	for (int y = 0; y < m_height; ++y)
+	{
+		for (int x = 0; x < m_width; ++x)
+		{
+			// 还没有采样的像素为黑色
+			const Pixel& pixel = m_pixels[x + y * m_width];
+			Vec3f color = pixel.count > 0 ? pixel.sum * (exposure / pixel.count) : Vec3f();
+			for (int i = 0; i < 3; ++i)
+			{
+				color[i] = linearToSRGB(toneMapACES(std::max(color[i], 0.f)));
+			}
+			image->set(x, y, TGAColor(color));
+		}
+	}
+}
@@ -0,0 +1,73 @@
+﻿#ifndef __ACCUMULATIONBUFFER_H__
+#define __ACCUMULATIONBUFFER_H__
+
+#include <vector>
+#include <limits>
+
+#include "geometry.h"
+#include "tgaimage.h"
+
+// 光线追踪的累积缓冲，每个像素累加线性的HDR颜色并记录采样数
+// 渲染过程中随时可以解析为当前的平均值，不会因为8位颜色的截断丢失精度
+// 同时累加亮度的平方，用于估计每个像素的方差，决定自适应采样何时停止
+class AccumulationBuffer
+{
+public:
+	AccumulationBuffer() = default;
+	~AccumulationBuffer() = default;
+
+	// 改变大小并清空
+	void resize(int width, int height);
+	void clear();
+
+	// 同一个像素同时只能由一个线程写入
+	void addSample(int x, int y, const Vec3f& radiance)
+	{
+		Pixel& pixel = m_pixels[x + y * m_width];
+		float lum = luminance(radiance);
+		pixel.sum = pixel.sum + radiance;
+		pixel.lumSqSum += lum * lum;
+		++pixel.count;
+	}
+
+	int sampleCount(int x, int y) const { return m_pixels[x + y * m_width].count; }
+
+	// 像素亮度均值的相对标准误差，少于2个采样时无法估计，返回最大值
+	// 亮度低于minLuminance时按minLuminance计算，暗处的噪声在色调映射后不明显，不需要同样的相对精度
+	float relativeError(int x, int y) const
+	{
+		const Pixel& pixel = m_pixels[x + y * m_width];
+		if (pixel.count < 2)
+			return std::numeric_limits<float>::max();
+
+		float n = (float)pixel.count;
+		float mean = luminance(pixel.sum) / n;
+		float variance = std::max((pixel.lumSqSum - mean * mean * n) / (n - 1.f), 0.f);
+		return std::sqrt(variance / n) / std::max(mean, minLuminance);
+	}
+
+	// 平均值乘以曝光，经过色调映射（ACES）与sRGB编码后写入image
+	void resolve(TGAImage* image, float exposure) const;
+
+private:
+	static constexpr float minLuminance = 0.01f;
+
+	// Rec.709的亮度
+	static float luminance(const Vec3f& color)
+	{
+		return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+	}
+
+	struct Pixel
+	{
+		Vec3f sum;             // 线性颜色之和
+		float lumSqSum = 0.f;  // 亮度的平方和
+		int count = 0;         // 采样数
+	};
+
+	std::vector<Pixel> m_pixels;
+	int m_width = 0;
+	int m_height = 0;
+};
+
+#endif // !__ACCUMULATIONBUFFER_H__
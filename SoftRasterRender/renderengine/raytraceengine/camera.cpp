@@ -0,0 +1,28 @@
+﻿#include "stdafx.h"
+#include "camera.h"
+
+void Camera::update(const Vec3f& position, const Matrix& view, const Matrix& projection, float near, int width, int height)
+{
+	m_position = position;
+	m_width = (float)width;
+	m_height = (float)height;
+
+	// 近平面上的点的裁剪坐标为(x * near, y * near, -near, near)，x、y为NDC坐标
+	// 逆变换只求一次，起点与增量都由它线性变换得到，增量的w为0，不受平移影响
+	Matrix invViewProj = (projection * view).invert();
+	m_origin = invViewProj * Vec4f{ -near, -near, -near, near };
+	m_stepX = invViewProj * Vec4f{ 2.f * near / width, 0.f, 0.f, 0.f };
+	m_stepY = invViewProj * Vec4f{ 0.f, 2.f * near / height, 0.f, 0.f };
+}
+
+Ray Camera::generateRay(float x, float y) const
+{
+	// 抖动后的坐标不能超出近平面
+	x = std::clamp(x, 0.f, m_width);
+	y = std::clamp(y, 0.f, m_height);
+
+	Ray ray;
+	ray.startPoint = m_origin + m_stepX * x + m_stepY * y;
+	ray.direction = Vec3f(ray.startPoint - m_position).normalize();
+	return ray;
+}
@@ -0,0 +1,29 @@
+﻿#ifndef __CAMERA_H__
+#define __CAMERA_H__
+
+#include "iobject.h"
+
+// 光线追踪的相机，每帧由视图、投影矩阵计算一次逆视图投影变换
+// 近平面上的点与NDC坐标是线性关系，只需保存一个起点与每个像素的增量，生成主光线只需几次乘加
+class Camera
+{
+public:
+	Camera() = default;
+	~Camera() = default;
+
+	// 更新相机，near为近裁剪面，width、height为渲染目标的大小
+	void update(const Vec3f& position, const Matrix& view, const Matrix& projection, float near, int width, int height);
+
+	// 生成经过像素坐标(x, y)的主光线，起点在近平面上，像素(0, 0)的左下角对应NDC的(-1, -1)
+	Ray generateRay(float x, float y) const;
+
+private:
+	Vec3f m_position; // 相机位置
+	Vec3f m_origin;   // 像素坐标(0, 0)在近平面上对应的世界坐标
+	Vec3f m_stepX;    // x方向每个像素的增量
+	Vec3f m_stepY;    // y方向每个像素的增量
+	float m_width = 0.f;
+	float m_height = 0.f;
+};
+
+#endif // !__CAMERA_H__
@@ -5,18 +5,38 @@
 #include "iobject.h"
 #include "objadapt.h"
 #include "scenemanager.h"
-
-#include <random>
+#include "sampler.h"
 
 namespace
 {
 	constexpr float PI = 3.1415926f;
+
+	// 每次采样的权重，漫反射方向在半球上均匀采样，概率密度的倒数为2PI
+	constexpr float sampleWeight = 2.0f * PI;
+
+	// 调度的分块大小，分块足够小才能在场景复杂度不均匀时让各线程同时结束
+	constexpr int tileSize = 16;
+
+	// 把低16位的比特间隔展开
+	uint32_t spreadBits(uint32_t v)
+	{
+		v &= 0x0000ffff;
+		v = (v | (v << 8)) & 0x00ff00ff;
+		v = (v | (v << 4)) & 0x0f0f0f0f;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	}
+
+	uint32_t mortonCode(int x, int y)
+	{
+		return spreadBits(x) | (spreadBits(y) << 1);
+	}
 }
 
 RayTraceEngine::RayTraceEngine()
 {
 	m_pSceneManager = std::make_unique<SceneManager>();
-	m_sampleWeight = (2.0f * PI) * (1.0f / m_sampleCount);// 每次采样的权重，平均一下
 }
 
 Matrix RayTraceEngine::lookat(Vec3f cameraPos, Vec3f target, Vec3f up)
@@ -69,6 +89,9 @@ void RayTraceEngine::setDevice(TGAImage* device)
 	m_width = device->get_width();
 	m_height = device->get_height();
 	m_pDevice = device;
+	m_accumulation.resize(m_width, m_height);
+	m_accumulatedSamples = 0;
+	_buildTileOrder();
 }
 
 IObject* RayTraceEngine::createObj(const Vec3f* pos)
@@ -106,201 +129,284 @@ void RayTraceEngine::setModeMatrix(const Matrix& mode)
 	m_pSceneManager->setModeMatrix(mode);
 }
 
-void RayTraceEngine::buildBVH(int count)
+void RayTraceEngine::buildBVH(int count, int width)
 {
-	m_pSceneManager->buildBVH(count);
+	m_pSceneManager->buildBVH(count, width);
 }
 
 void RayTraceEngine::setSampleCount(int count)
 {
 	m_sampleCount = count;
-	m_sampleWeight = (2.0f * PI) * (1.0f / m_sampleCount);// 每次采样的权重，平均一下
+}
+
+void RayTraceEngine::setAdaptiveSampling(int minSamples, float targetError)
+{
+	m_minSamples = std::max(1, minSamples);
+	m_targetError = targetError;
+}
+
+void RayTraceEngine::setTimeBudget(float seconds)
+{
+	m_timeBudget = seconds;
+}
+
+void RayTraceEngine::setSamplerType(const SamplerType type)
+{
+	m_samplerType = type;
+}
+
+void RayTraceEngine::setExposure(float exposure)
+{
+	m_exposure = exposure;
 }
 
 void RayTraceEngine::rayGeneration(const ExecutexType type)
 {
-	// 并行渲染
+	clearAccumulation();
+	_updateCamera();
+
+	if (m_targetError <= 0.f && m_timeBudget <= 0.f)
+	{
+		_renderPass(m_sampleCount, m_sampleCount, type, Clock::time_point::max());
+	}
+	else
+	{
+		Clock::time_point deadline = Clock::time_point::max();
+		if (m_timeBudget > 0.f)
+			deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<float>(m_timeBudget));
+
+		// 分轮渲染，每轮结束后重新估计误差，收敛的像素之后不再花费时间
+		// 像素的采样数可能不同（周围的像素重新变为未收敛时会继续采样），按每个像素的采样数判断是否达到上限
+		while (Clock::now() < deadline)
+		{
+			if (_renderPass(m_minSamples, m_sampleCount, type, deadline) == 0)
+				break; // 所有像素都已收敛或者达到采样数上限
+		}
+	}
+
+	resolve();
+}
+
+void RayTraceEngine::clearAccumulation()
+{
+	m_accumulation.clear();
+	m_accumulatedSamples = 0;
+}
+
+int RayTraceEngine::renderPass(int samples, const ExecutexType type)
+{
+	_updateCamera();
+	_renderPass(samples, std::numeric_limits<int>::max(), type, Clock::time_point::max());
+	return m_accumulatedSamples;
+}
+
+void RayTraceEngine::resolve()
+{
+	m_accumulation.resolve(m_pDevice, m_exposure);
+}
+
+void RayTraceEngine::_updateCamera()
+{
+	m_camera.update(m_pSceneManager->getCameraPos(), m_pSceneManager->getViewMatrix(), m_pSceneManager->getProMatrix(), m_near, m_width, m_height);
+}
+
+int RayTraceEngine::_renderPass(int samples, int sampleLimit, const ExecutexType type, Clock::time_point deadline)
+{
+	_updateConvergence();
+
+	PassStats stats;
 	if (type == ExecutexType::Asynchronous)
 	{
-		_syncRayGeneration();
+		stats = _syncRayGeneration(samples, sampleLimit, deadline);
+	}
+	else
+	{
+		std::atomic_int nextTile = 0;
+		stats = _renderTiles(nextTile, samples, sampleLimit, deadline);
+	}
+
+	// 跳过的像素与到时后没有领取的分块不会增加采样数，只记录实际达到的最大值
+	m_accumulatedSamples = std::max(m_accumulatedSamples, stats.maxSampleCount);
+	return stats.pixelCount;
+}
+
+void RayTraceEngine::_updateConvergence()
+{
+	if (m_targetError <= 0.f)
 		return;
+
+	m_converged.resize((size_t)m_width * m_height);
+	for (int row = 0; row < m_height; ++row)
+	{
+		for (int col = 0; col < m_width; ++col)
+		{
+			m_converged[col + row * m_width] = m_accumulation.sampleCount(col, row) >= m_minSamples
+				&& m_accumulation.relativeError(col, row) <= m_targetError;
+		}
 	}
+}
+
+bool RayTraceEngine::_isConverged(int col, int row) const
+{
+	if (m_targetError <= 0.f)
+		return false;
 
-	Vec3f cameraPos = m_pSceneManager->getCameraPos();
-	for (int count = 0; count < m_sampleCount; ++count)
+	// 单个像素的方差在采样较少时不可靠，例如几个采样都没有到达光源的像素误差为0
+	// 周围3x3的像素都收敛时才停止，噪声区域的边缘会继续采样
+	for (int y = std::max(row - 1, 0); y <= std::min(row + 1, m_height - 1); ++y)
 	{
-		for (int row = 0; row < m_height; ++row)
+		for (int x = std::max(col - 1, 0); x <= std::min(col + 1, m_width - 1); ++x)
 		{
-			for (int col = 0; col < m_width; ++col)
+			if (!m_converged[x + y * m_width])
+				return false;
+		}
+	}
+	return true;
+}
+
+Vec3f RayTraceEngine::_traceSample(int col, int row, int sampleIndex, Sampler& sampler)
+{
+	// 引入随机采样，减少锯齿，采样位置在像素内抖动四分之一个像素
+	sampler.startSample(col, row, sampleIndex);
+	Vec2f jitter = sampler.get2D();
+	float x = col + (jitter.x - 0.5f) * 0.5f;
+	float y = row + (jitter.y - 0.5f) * 0.5f;
+
+	// 生成从近裁剪面发射的光线
+	Ray ray = m_camera.generateRay(x, y);
+
+	// 求交点
+	HitResult hitRes = m_pSceneManager->closestHitByBVH(ray);
+	//HitResult hitRes = m_pSceneManager->closestHit(ray);
+	if (!hitRes.isHit)
+		return Vec3f();
+
+	// 命中光源直接返回光源颜色
+	if (hitRes.material.isEmissive)
+		return RenderEngine::colorToRGB(hitRes.material.color);
+
+	Ray randomRay;
+	randomRay.startPoint = hitRes.hitPoint;
+	randomRay.direction = RenderEngine::randomDirection(hitRes.material.normal, sampler.get2D());
+
+	// 根据反射率决定光线最终的方向
+	Vec3f color;
+	float r = sampler.get1D();
+	if (r < hitRes.material.specularRate)
+	{
+		// 镜面反射
+		randomRay.direction = randomRay.direction * -1;
+		Vec3f ref = RenderEngine::reflect(hitRes.material.normal, ray.direction).normalize();
+		randomRay.direction = RenderEngine::mix(ref, randomRay.direction, hitRes.material.roughness);
+		color = m_pSceneManager->pathTracing(randomRay, 0, sampler);
+	}
+	else if (hitRes.material.specularRate <= r && r <= hitRes.material.refractRate)
+	{
+		// 折射
+		Vec3f ref = RenderEngine::refract(ray.direction, hitRes.material.normal, hitRes.material.refractAngle).normalize();
+		randomRay.direction = RenderEngine::mix(ref, randomRay.direction, hitRes.material.refractRoughness);
+		color = m_pSceneManager->pathTracing(randomRay, 0, sampler);
+	}
+	else
+	{
+		// 漫反射
+		randomRay.direction = randomRay.direction * -1;
+		Vec3f albedo = RenderEngine::colorToRGB(m_pSceneManager->getTGATexture("diffuse", hitRes.material.texCoords));
+		color = multiply_elements(m_pSceneManager->pathTracing(randomRay, 0, sampler), albedo); // 和原颜色混合
+	}
+	return color * sampleWeight;
+}
+
+void RayTraceEngine::_buildTileOrder()
+{
+	m_tileCols = (m_width + tileSize - 1) / tileSize;
+	int tileRows = (m_height + tileSize - 1) / tileSize;
+
+	m_tileOrder.resize(m_tileCols * tileRows);
+	for (int i = 0; i < (int)m_tileOrder.size(); ++i)
+		m_tileOrder[i] = i;
+
+	std::sort(m_tileOrder.begin(), m_tileOrder.end(), [this](int a, int b)
+		{
+			return mortonCode(a % m_tileCols, a / m_tileCols) < mortonCode(b % m_tileCols, b / m_tileCols);
+		});
+}
+
+RayTraceEngine::PassStats RayTraceEngine::_renderTile(int tileIndex, int samples, int sampleLimit, Sampler& sampler)
+{
+	int minX = (tileIndex % m_tileCols) * tileSize;
+	int minY = (tileIndex / m_tileCols) * tileSize;
+	int maxX = std::min(minX + tileSize, m_width);
+	int maxY = std::min(minY + tileSize, m_height);
+
+	// 采样在最内层，同一像素的光线相干性最好，每个像素的采样按序号顺序累加，结果与调度无关
+	PassStats stats;
+	for (int row = minY; row < maxY; ++row)
+	{
+		for (int col = minX; col < maxX; ++col)
+		{
+			if (_isConverged(col, row))
+				continue;
+
+			// 采样序号接着像素已有的采样继续，采样器的序列不会重复
+			int firstSample = m_accumulation.sampleCount(col, row);
+			int endSample = std::min(firstSample + samples, sampleLimit);
+			if (endSample <= firstSample)
+				continue;
+
+			for (int count = firstSample; count < endSample; ++count)
 			{
-				// 转换到NDC坐标
-				float clipRow = 2.f * row / m_height - 1.f;
-				float clipCol = 2.f * col / m_width - 1.f;
-
-				// 引入随机采样，减少锯齿
-				clipRow += (RenderEngine::randf() - 0.5f) / m_height;
-				clipCol += (RenderEngine::randf() - 0.5f) / m_width;
-				clipRow = std::clamp(clipRow, -1.f, 1.f);
-				clipCol = std::clamp(clipCol, -1.f, 1.f);
-
-				// 这里注意，col对应的是y轴，row对应的是x轴
-				Vec4f projPos{ clipCol * m_near, clipRow * m_near, -m_near, m_near }; // 都是从近裁剪面发射的
-
-				// 生成光线
-				Ray ray;
-				ray.startPoint = m_pSceneManager->projTransform2World(projPos);
-				ray.direction = Vec3f(ray.startPoint - cameraPos).normalize();
-
-				// 求交点
-				HitResult hitRes = m_pSceneManager->closestHitByBVH(ray);
-				//HitResult hitRes = m_pSceneManager->closestHit(ray);
-				TGAColor tgaColor;
-				if (hitRes.isHit)
-				{
-					// 命中光源直接返回光源颜色
-					if (hitRes.material.isEmissive)
-					{
-						tgaColor = hitRes.material.color;
-					}
-					else
-					{
-						Ray randomRay;
-						randomRay.startPoint = hitRes.hitPoint;
-						randomRay.direction = RenderEngine::randomDirection(hitRes.material.normal).normalize();
-
-						// 根据反射率决定光线最终的方向
-						float r = RenderEngine::randf();
-						if (r < hitRes.material.specularRate)
-						{
-							// 镜面反射
-							randomRay.direction = randomRay.direction * -1;
-							Vec3f ref = RenderEngine::reflect(hitRes.material.normal, ray.direction).normalize();
-							randomRay.direction = RenderEngine::mix(ref, randomRay.direction, hitRes.material.roughness);
-							tgaColor = m_pSceneManager->pathTracing(randomRay, 0);
-						}
-						else if (hitRes.material.specularRate <= r && r <= hitRes.material.refractRate)
-						{
-							// 折射
-							Vec3f ref = RenderEngine::refract(ray.direction, hitRes.material.normal, hitRes.material.refractAngle).normalize();
-							randomRay.direction = RenderEngine::mix(ref, randomRay.direction, hitRes.material.refractRoughness);
-							tgaColor = m_pSceneManager->pathTracing(randomRay, 0);
-						}
-						else
-						{
-							// 漫反射
-							randomRay.direction = randomRay.direction * -1;
-							tgaColor = m_pSceneManager->getTGATexture("diffuse", hitRes.material.texCoords);
-							TGAColor ptColor = m_pSceneManager->pathTracing(randomRay, 0);
-							tgaColor = ptColor * tgaColor; // 和原颜色混合
-						}
-						tgaColor = tgaColor * m_sampleWeight;
-					}
-				}
-
-				m_pDevice->set(col, row, m_pDevice->get(col, row) + tgaColor);
+				m_accumulation.addSample(col, row, _traceSample(col, row, count, sampler));
 			}
+			++stats.pixelCount;
+			stats.maxSampleCount = std::max(stats.maxSampleCount, endSample);
 		}
 	}
+	return stats;
 }
 
-void RayTraceEngine::_syncRayGeneration()
+RayTraceEngine::PassStats RayTraceEngine::_renderTiles(std::atomic_int& nextTile, int samples, int sampleLimit, Clock::time_point deadline)
 {
-	Vec3f cameraPos = m_pSceneManager->getCameraPos();
+	// 每个线程有自己的采样器，采样值只与像素、采样序号有关
+	Sampler sampler(m_samplerType, m_sampleCount);
 
-	// 划分每个线程需要完成的行数
+	PassStats stats;
+	int tileCount = (int)m_tileOrder.size();
+	for (int i = nextTile.fetch_add(1); i < tileCount && Clock::now() < deadline; i = nextTile.fetch_add(1))
+	{
+		PassStats tileStats = _renderTile(m_tileOrder[i], samples, sampleLimit, sampler);
+		stats.pixelCount += tileStats.pixelCount;
+		stats.maxSampleCount = std::max(stats.maxSampleCount, tileStats.maxSampleCount);
+	}
+	return stats;
+}
+
+RayTraceEngine::PassStats RayTraceEngine::_syncRayGeneration(int samples, int sampleLimit, Clock::time_point deadline)
+{
+	// 线程池按核心数创建线程，不用idleThreadCount，上一轮的任务刚返回结果时线程可能还没有计为空闲
 	ThreadPool& threadPool = ThreadPool::instance();
-	int threadCount = threadPool.idleThreadCount();
-	int taskSize = std::max(1, m_height / threadCount); // 任务大小至少为 1 行
-	int totalTasks = (m_height + taskSize - 1) / taskSize; // 向上取整，确保每行都被渲染
+	int threadCount = std::min(std::max(1, (int)std::thread::hardware_concurrency()), (int)m_tileOrder.size());
 
-	std::vector<std::future<void>> taskFutures;
-	for (int taskIndex = 0; taskIndex < totalTasks; ++taskIndex)
+	// 每个线程一个任务，任务内动态领取分块，而不是预先静态划分行
+	std::atomic_int nextTile = 0;
+	std::vector<std::future<PassStats>> taskFutures;
+	for (int taskIndex = 0; taskIndex < threadCount; ++taskIndex)
 	{
-		// 计算当前任务负责的行范围
-		int startRow = taskIndex * taskSize;
-		int endRow = std::min(startRow + taskSize, m_height); // 不要超出 m_height
-
-		// 将任务提交到线程池，传入 startRow 和 endRow
-		auto future = threadPool.commit([=]
+		auto future = threadPool.commit([this, &nextTile, samples, sampleLimit, deadline]
 			{
-				for (int count = 0; count < m_sampleCount; ++count)
-				{
-					for (int row = startRow; row < endRow; ++row)
-					{
-						for (int col = 0; col < m_width; ++col)
-						{
-							// 转换到NDC坐标
-							float clipRow = 2.f * row / m_height - 1.f;
-							float clipCol = 2.f * col / m_width - 1.f;
-
-							// 引入随机采样，减少锯齿
-							clipRow += (RenderEngine::randf() - 0.5f) / m_height;
-							clipCol += (RenderEngine::randf() - 0.5f) / m_width;
-							clipRow = std::clamp(clipRow, -1.f, 1.f);
-							clipCol = std::clamp(clipCol, -1.f, 1.f);
-
-							// 这里注意，col对应的是y轴，row对应的是x轴
-							Vec4f projPos{ clipCol * m_near, clipRow * m_near, -m_near, m_near }; // 都是从近裁剪面发射的
-
-							// 生成光线
-							Ray ray;
-							ray.startPoint = m_pSceneManager->projTransform2World(projPos);
-							ray.direction = Vec3f(ray.startPoint - cameraPos).normalize();
-
-							// 求交点
-							HitResult hitRes = m_pSceneManager->closestHitByBVH(ray);
-							//HitResult hitRes = m_pSceneManager->closestHit(ray);
-							TGAColor tgaColor;
-							if (hitRes.isHit)
-							{
-								if (hitRes.material.isEmissive)
-								{
-									tgaColor = hitRes.material.color;
-								}
-								else
-								{
-									Ray randomRay;
-									randomRay.startPoint = hitRes.hitPoint;
-									randomRay.direction = RenderEngine::randomDirection(hitRes.material.normal);
-
-									float r = RenderEngine::randf();
-									if (r < hitRes.material.specularRate)
-									{
-										randomRay.direction = randomRay.direction * -1;
-										Vec3f ref = RenderEngine::reflect(hitRes.material.normal, ray.direction).normalize();
-										randomRay.direction = RenderEngine::mix(ref, randomRay.direction, hitRes.material.roughness);
-										tgaColor = m_pSceneManager->pathTracing(randomRay, 0);
-									}
-									else if (hitRes.material.specularRate <= r && r <= hitRes.material.refractRate)
-									{
-										Vec3f ref = RenderEngine::refract(ray.direction, hitRes.material.normal, hitRes.material.refractAngle).normalize();
-										randomRay.direction = RenderEngine::mix(ref, randomRay.direction, hitRes.material.refractRoughness);
-										tgaColor = m_pSceneManager->pathTracing(randomRay, 0);
-									}
-									else
-									{
-										// 漫反射
-										randomRay.direction = randomRay.direction * -1;
-										tgaColor = m_pSceneManager->getTGATexture("diffuse", hitRes.material.texCoords);
-										TGAColor ptColor = m_pSceneManager->pathTracing(randomRay, 0);
-										tgaColor = ptColor * tgaColor; // 和原颜色混合
-									}
-									tgaColor = tgaColor * m_sampleWeight;
-								}
-							}
-
-							m_pDevice->set(col, row, m_pDevice->get(col, row) + tgaColor);
-						}
-					}
-				}
+				return _renderTiles(nextTile, samples, sampleLimit, deadline);
 			});
 
 		taskFutures.push_back(std::move(future));
 	}
 
 	// 等待所有任务完成
+	PassStats stats;
 	for (auto& future : taskFutures)
 	{
-		future.get();
+		PassStats taskStats = future.get();
+		stats.pixelCount += taskStats.pixelCount;
+		stats.maxSampleCount = std::max(stats.maxSampleCount, taskStats.maxSampleCount);
 	}
+	return stats;
 }
@@ -2,10 +2,16 @@
 #define __RAYTRACEENGINE_H__
 
 #include "irenderengine.h"
+#include "camera.h"
+#include "accumulationbuffer.h"
 #include <memory>
+#include <vector>
+#include <atomic>
+#include <chrono>
 
 interface IObject;
 class SceneManager;
+class Sampler;
 
 class RayTraceEngine : public IRayTraceRenderEngin
 {
@@ -33,9 +39,13 @@ public:
 	virtual void setTexture(const std::string& texName, TGAImage&& img) override;
 	virtual void setModeMatrix(const Matrix& mode) override;
 
-	virtual void buildBVH(int count) override;
+	virtual void buildBVH(int count, int width = 2) override;
 
 	virtual void setSampleCount(int count) override;
+	virtual void setAdaptiveSampling(int minSamples, float targetError) override;
+	virtual void setTimeBudget(float seconds) override;
+	virtual void setSamplerType(const SamplerType type) override;
+	virtual void setExposure(float exposure) override;
 
 	// 设置光线追踪的最大深度
 	virtual void setMaxDepth(int depth) override;
@@ -43,16 +53,67 @@ public:
 	// 开始渲染
 	virtual void rayGeneration(const ExecutexType type = ExecutexType::Asynchronous) override;
 
+	// 渐进式渲染
+	virtual void clearAccumulation() override;
+	virtual int renderPass(int samples, const ExecutexType type = ExecutexType::Asynchronous) override;
+	virtual void resolve() override;
+
 private:
-	void _syncRayGeneration();
+	using Clock = std::chrono::steady_clock;
+
+	// 一轮渲染实际完成的采样
+	struct PassStats
+	{
+		int pixelCount = 0;     // 采样过的像素个数
+		int maxSampleCount = 0; // 采样过的像素中最多的采样数
+	};
+
+	// 逆视图投影变换每次渲染只计算一次
+	void _updateCamera();
+
+	// 为每个未收敛的像素累积samples个采样，每个像素最多sampleLimit个，到达deadline后不再领取新的分块
+	// 返回这一轮采样过的像素个数
+	int _renderPass(int samples, int sampleLimit, const ExecutexType type, Clock::time_point deadline);
+
+	// 屏幕分块按Morton顺序排列，相邻的分块在场景中也相邻，访问的BVH节点与三角形更可能还在缓存中
+	void _buildTileOrder();
+
+	// 在线程池中并行渲染
+	PassStats _syncRayGeneration(int samples, int sampleLimit, Clock::time_point deadline);
+
+	// 不断从nextTile领取下一个分块渲染，直到所有分块都被领取，每个线程渲染完一块才领取下一块，负载自动均衡
+	PassStats _renderTiles(std::atomic_int& nextTile, int samples, int sampleLimit, Clock::time_point deadline);
+
+	// 渲染一个分块，每个像素连续完成所有采样再处理下一个像素，采样序号接着像素已有的采样数
+	PassStats _renderTile(int tileIndex, int samples, int sampleLimit, Sampler& sampler);
+
+	// 每轮渲染开始前标记已经有足够的采样且误差低于目标的像素
+	void _updateConvergence();
+
+	// 像素与周围的像素都已收敛，只读取每轮开始时的标记，与其他线程写入的累积缓冲无关
+	bool _isConverged(int col, int row) const;
+
+	// 像素(col, row)的第sampleIndex个采样，返回线性的HDR颜色
+	Vec3f _traceSample(int col, int row, int sampleIndex, Sampler& sampler);
 
 private:
 	std::unique_ptr<SceneManager> m_pSceneManager;
+	Camera m_camera; // 每次渲染开始时更新一次
 	TGAImage* m_pDevice = nullptr;
 	float m_near = 0.1f;
-	float m_sampleWeight = 0;
+	float m_exposure = 1.f;
 	int m_width = 0;
 	int m_height = 0;
 	int m_sampleCount = 4096;
+	int m_minSamples = 16;
+	float m_targetError = 0.f; // 不大于0时关闭自适应采样
+	float m_timeBudget = 0.f;  // 秒，不大于0时不限制
+	SamplerType m_samplerType = SamplerType::Sobol;
+
+	AccumulationBuffer m_accumulation; // 大小与目标设备相同
+	std::vector<uint8_t> m_converged;  // 自适应采样时每个像素是否收敛，渲染过程中只读
+	std::vector<int> m_tileOrder; // 按Morton顺序排列的分块序号，分块按行优先编号
+	int m_tileCols = 0;
+	int m_accumulatedSamples = 0; // 累积缓冲中像素最多的采样数
 };
 #endif // !__RAYTRACEENGINE_H__
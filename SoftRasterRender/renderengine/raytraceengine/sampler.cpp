@@ -0,0 +1,200 @@
+﻿#include "stdafx.h"
+#include "sampler.h"
+
+namespace
+{
+	// 32位整数哈希（lowbias32），由像素、维度等得到互不相关的种子
+	uint32_t hash(uint32_t x)
+	{
+		x ^= x >> 16;
+		x *= 0x7feb352du;
+		x ^= x >> 15;
+		x *= 0x846ca68bu;
+		x ^= x >> 16;
+		return x;
+	}
+
+	uint32_t hash(uint32_t a, uint32_t b)
+	{
+		return hash(hash(a) ^ b);
+	}
+
+	// 高24位转为[0, 1)的float，结果不会等于1
+	float toUnitFloat(uint32_t bits)
+	{
+		return (bits >> 8) * (1.f / (1u << 24));
+	}
+
+	uint32_t reverseBits(uint32_t x)
+	{
+		x = (x << 16) | (x >> 16);
+		x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+		x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+		x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+		x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+		return x;
+	}
+
+	// Owen扰乱：位反转后用Laine-Karras置换，每一位只受更高位影响，扰乱后仍是(0, 2)序列
+	uint32_t owenScramble(uint32_t x, uint32_t seed)
+	{
+		x = reverseBits(x);
+		x += seed;
+		x ^= x * 0x6c50b47cu;
+		x ^= x * 0xb82f1e52u;
+		x ^= x * 0xc7afe638u;
+		x ^= x * 0x8d22f6e6u;
+		return reverseBits(x);
+	}
+
+	// Sobol序列的前两个维度，第一维是位反转的van der Corput序列
+	uint32_t sobol0(uint32_t index)
+	{
+		return reverseBits(index);
+	}
+
+	constexpr uint32_t sobol1Bits(uint32_t index)
+	{
+		uint32_t result = 0;
+		for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+		{
+			if (index & 1)
+				result ^= v;
+		}
+		return result;
+	}
+
+	// 第二维是生成矩阵与index的异或乘法，按字节拆成4张查找表，打乱后的index通常占满32位，逐位计算较慢
+	struct Sobol1Table
+	{
+		uint32_t values[4][256];
+
+		constexpr Sobol1Table() : values()
+		{
+			for (uint32_t k = 0; k < 4; ++k)
+			{
+				for (uint32_t b = 0; b < 256; ++b)
+					values[k][b] = sobol1Bits(b << (8 * k));
+			}
+		}
+	};
+	constexpr Sobol1Table sobol1Table;
+
+	uint32_t sobol1(uint32_t index)
+	{
+		return sobol1Table.values[0][index & 0xff] ^ sobol1Table.values[1][(index >> 8) & 0xff]
+			^ sobol1Table.values[2][(index >> 16) & 0xff] ^ sobol1Table.values[3][index >> 24];
+	}
+
+	// Kensler的可逆置换，把[0, length)中的index映射到另一个位置，不需要生成整个排列
+	uint32_t permute(uint32_t index, uint32_t length, uint32_t seed)
+	{
+		uint32_t mask = length - 1;
+		mask |= mask >> 1;
+		mask |= mask >> 2;
+		mask |= mask >> 4;
+		mask |= mask >> 8;
+		mask |= mask >> 16;
+		do
+		{
+			index ^= seed;
+			index *= 0xe170893du;
+			index ^= seed >> 16;
+			index ^= (index & mask) >> 4;
+			index ^= seed >> 8;
+			index *= 0x0929eb3fu;
+			index ^= seed >> 23;
+			index ^= (index & mask) >> 1;
+			index *= 1 | seed >> 27;
+			index *= 0x6935fa69u;
+			index ^= (index & mask) >> 11;
+			index *= 0x74dcb303u;
+			index ^= (index & mask) >> 2;
+			index *= 0x9e501cc3u;
+			index ^= (index & mask) >> 2;
+			index *= 0xc860a3dfu;
+			index &= mask;
+			index ^= index >> 5;
+		} while (index >= length);
+		return (index + seed) % length;
+	}
+}
+
+Sampler::Sampler(const SamplerType type, int sampleCount, uint32_t seed)
+	: m_type(type), m_sampleCount((uint32_t)std::max(sampleCount, 1)), m_seed(seed)
+{
+	// 取不超过平方根的最大因数，网格正好有m_sampleCount个格子，采样数为质数时退化为N皇后分布
+	m_gridX = (uint32_t)std::sqrt((float)m_sampleCount);
+	while (m_sampleCount % m_gridX != 0)
+		--m_gridX;
+	m_gridY = m_sampleCount / m_gridX;
+}
+
+void Sampler::startSample(int x, int y, int sampleIndex)
+{
+	m_pixelSeed = hash(hash((uint32_t)x, (uint32_t)y), m_seed);
+	m_sampleIndex = (uint32_t)sampleIndex;
+	m_dimension = 0;
+	if (m_type == SamplerType::Random)
+		m_rng.seed(m_pixelSeed, m_sampleIndex);
+}
+
+uint32_t Sampler::_stratifiedSeed(uint32_t dimSeed) const
+{
+	// 第一轮保持原来的种子
+	uint32_t round = m_sampleIndex / m_sampleCount;
+	return round == 0 ? dimSeed : hash(dimSeed, round);
+}
+
+float Sampler::get1D()
+{
+	uint32_t dimSeed = hash(m_pixelSeed, m_dimension++);
+	switch (m_type)
+	{
+	case SamplerType::Stratified:
+	{
+		// 每个维度把采样序号随机置换到不同的层，层内再抖动
+		dimSeed = _stratifiedSeed(dimSeed);
+		uint32_t stratum = permute(m_sampleIndex % m_sampleCount, m_sampleCount, dimSeed);
+		return (stratum + toUnitFloat(hash(m_sampleIndex, dimSeed))) / m_sampleCount;
+	}
+	case SamplerType::Sobol:
+	{
+		// 每个维度打乱采样的顺序并单独扰乱，各维度之间不相关
+		uint32_t index = owenScramble(m_sampleIndex, dimSeed);
+		return toUnitFloat(owenScramble(sobol0(index), hash(dimSeed)));
+	}
+	default:
+		return toUnitFloat(m_rng.next());
+	}
+}
+
+Vec2f Sampler::get2D()
+{
+	uint32_t dimSeed = hash(m_pixelSeed, m_dimension);
+	m_dimension += 2;
+	switch (m_type)
+	{
+	case SamplerType::Stratified:
+	{
+		// Kensler的相关多重抖动，二维上是m_gridX * m_gridY的分层，每一维上又是m_sampleCount层
+		dimSeed = _stratifiedSeed(dimSeed);
+		uint32_t s = permute(m_sampleIndex % m_sampleCount, m_sampleCount, dimSeed * 0x51633e2du);
+		uint32_t sx = permute(s % m_gridX, m_gridX, dimSeed * 0x68bc21ebu);
+		uint32_t sy = permute(s / m_gridX, m_gridY, dimSeed * 0x02e5be93u);
+		float jx = toUnitFloat(hash(s, dimSeed * 0x967a889bu));
+		float jy = toUnitFloat(hash(s, dimSeed * 0x368cc8b7u));
+		return Vec2f((s % m_gridX + (sy + jx) / m_gridY) / m_gridX, (s / m_gridX + (sx + jy) / m_gridX) / m_gridY);
+	}
+	case SamplerType::Sobol:
+	{
+		uint32_t index = owenScramble(m_sampleIndex, dimSeed);
+		return Vec2f(toUnitFloat(owenScramble(sobol0(index), hash(dimSeed, 0u))), toUnitFloat(owenScramble(sobol1(index), hash(dimSeed, 1u))));
+	}
+	default:
+	{
+		float u = toUnitFloat(m_rng.next());
+		return Vec2f(u, toUnitFloat(m_rng.next()));
+	}
+	}
+}
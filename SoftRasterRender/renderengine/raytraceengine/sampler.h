@@ -0,0 +1,67 @@
+﻿#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+
+#include "irenderengine.h"
+
+// PCG32随机数生成器，状态只有16字节，每个采样单独播种，不在线程之间共享
+class Pcg32
+{
+public:
+	Pcg32() = default;
+
+	// state为初始状态，sequence选择互不相关的序列
+	void seed(uint64_t state, uint64_t sequence)
+	{
+		m_state = 0u;
+		m_inc = (sequence << 1u) | 1u;
+		next();
+		m_state += state;
+		next();
+	}
+
+	uint32_t next()
+	{
+		uint64_t oldState = m_state;
+		m_state = oldState * 6364136223846793005ull + m_inc;
+		uint32_t xorShifted = (uint32_t)(((oldState >> 18u) ^ oldState) >> 27u);
+		uint32_t rot = (uint32_t)(oldState >> 59u);
+		return (xorShifted >> rot) | (xorShifted << ((~rot + 1u) & 31));
+	}
+
+private:
+	uint64_t m_state = 0x853c49e6748fea9bull;
+	uint64_t m_inc = 0xda3e39cb94b95bdbull;
+};
+
+// 采样器，按（像素，采样序号，维度）给出[0, 1)内的采样值，结果只由这三者决定，与线程的划分无关
+// 每个采样先调用startSample，之后每次get1D占用一个维度，get2D占用两个维度
+// 同一条路径中各维度的用途要固定，例如先是像素内的偏移，之后每次弹射依次是方向、材质的选择、俄罗斯轮盘赌
+class Sampler
+{
+public:
+	// sampleCount为每个像素的采样数，分层采样据此划分层，seed改变整幅图的随机序列
+	Sampler(const SamplerType type, int sampleCount, uint32_t seed = 0);
+
+	// 开始像素(x, y)的第sampleIndex个采样
+	void startSample(int x, int y, int sampleIndex);
+
+	float get1D();
+	Vec2f get2D();
+
+private:
+	// 分层采样的种子，采样序号超过sampleCount后每一轮重新置换与抖动，是另一组完整的分层，不会重复之前的采样
+	uint32_t _stratifiedSeed(uint32_t dimSeed) const;
+
+	SamplerType m_type;
+	uint32_t m_sampleCount;
+	uint32_t m_gridX; // 二维分层的网格，m_gridX * m_gridY == m_sampleCount
+	uint32_t m_gridY;
+	uint32_t m_seed;
+
+	uint32_t m_pixelSeed = 0; // 由像素坐标与seed得到
+	uint32_t m_sampleIndex = 0;
+	uint32_t m_dimension = 0;
+	Pcg32 m_rng; // 随机采样使用
+};
+
+#endif // !__SAMPLER_H__
@@ -1,4 +1,5 @@
 ﻿#include "stdafx.h"
+#include "threadpool.h"
 #include "common.h"
 #include "scenemanager.h"
 
@@ -7,24 +8,38 @@ namespace
 	// 精度
 	constexpr float epsilon = 1e-5f;
 
+	// 三角形求交的精度，与TriangleObj::intersect一致
+	constexpr float triangleEpsilon = 1e-9f;
+
 	// 俄罗斯轮盘赌，终止概率
 	constexpr float russianRouletteChance = 0.8f;
 
-	// 按照中心排序 -- 比较函数
-	bool cmpx(IObject* left, IObject* right)
-	{
-		return left->center().x < right->center().x;
-	}
+	// BVH遍历栈的大小，树的深度不能超过它
+	constexpr int bvhStackSize = 64;
+
+	// SAH划分可能很不平衡，超过这个深度后改为按中位数划分，保证深度不超过遍历栈
+	constexpr int maxSAHDepth = 32;
+
+	// SAH每个轴上的箱子数
+	constexpr int sahBinCount = 16;
 
-	bool cmpy(IObject* left, IObject* right)
+	// 图元数不少于它的子树才值得提交到线程池
+	constexpr int minBVHTaskSize = 4096;
+
+	// 包围盒的表面积
+	float surfaceArea(const Vec3f& AA, const Vec3f& BB)
 	{
-		return left->center().y < right->center().y;
+		Vec3f len = BB - AA;
+		return 2 * (len.x * len.y + len.x * len.z + len.y * len.z);
 	}
 
-	bool cmpz(IObject* left, IObject* right)
+	// 分箱时的一个箱子
+	struct SAHBin
 	{
-		return left->center().z < right->center().z;
-	}
+		Vec3f AA = Vec3f(FLT_MAX);
+		Vec3f BB = Vec3f(-FLT_MAX);
+		int count = 0;
+	};
 }
 
 SceneManager::~SceneManager()
@@ -33,9 +48,6 @@ SceneManager::~SceneManager()
 	{
 		delete obj;
 	}
-
-	_deleteBVH(m_pBVHRoot);
-	m_pBVHRoot = nullptr;
 }
 
 void SceneManager::addObj(IObject* obj)
@@ -56,20 +68,22 @@ void SceneManager::addLight(IObject* obj, const Vec3f& color)
 
 void SceneManager::setTexture(const std::string texName, TGAImage* img)
 {
+	// 接管了图像的所有权，纹理构建完成后原图即可释放
+	std::unique_ptr<TGAImage> pImage(img);
 	auto item = m_texs.find(texName);
 	if (item != m_texs.end())
-		item->second.reset(img);
+		item->second.reset(new Texture(*pImage));
 	else
-		m_texs.insert(std::make_pair(texName, img));
+		m_texs.insert(std::make_pair(texName, new Texture(*pImage)));
 }
 
 void SceneManager::setTexture(const std::string texName, TGAImage&& img)
 {
 	auto item = m_texs.find(texName);
 	if (item != m_texs.end())
-		item->second.reset(new TGAImage(std::move(img)));
+		item->second.reset(new Texture(img));
 	else
-		m_texs.insert(std::make_pair(texName, new TGAImage(std::move(img))));
+		m_texs.insert(std::make_pair(texName, new Texture(img)));
 }
 
 void SceneManager::setCameraPos(const Vec3f& pos)
@@ -102,6 +116,16 @@ void SceneManager::setViewportMatrix(const Matrix& viewport)
 	m_viewportMatrix = viewport;
 }
 
+Matrix SceneManager::getViewMatrix() const
+{
+	return m_viewMatrix;
+}
+
+Matrix SceneManager::getProMatrix() const
+{
+	return m_proMatrix;
+}
+
 Matrix SceneManager::getViewportMatrix()
 {
 	return m_viewportMatrix;
@@ -113,32 +137,81 @@ TGAColor SceneManager::getTGATexture(const std::string& texName, const Vec2f& uv
 	TGAColor tgaColor;
 	auto itemTex = m_texs.find(texName);
 	if (itemTex != m_texs.end())
-		tgaColor = itemTex->second->diffuse(uv);
+		tgaColor = itemTex->second->sample(uv, 0.f, TextureFilter::Bilinear); // 光线没有差分信息，只采样第0层
 
 	return tgaColor;
 }
 
-Vec3f SceneManager::projTransform2World(const Vec4f& clipPos)
+void SceneManager::buildBVH(int count, int width)
 {
-	// 从裁剪坐标到视锥体坐标
-	Matrix invProjMatrix = m_proMatrix.invert();
-	Vec4f viewPos = invProjMatrix * clipPos;
+	m_bvhNodes.clear();
+	m_bvh4Nodes.clear();
+	m_bvh8Nodes.clear();
+	m_triangleBlocks.clear();
+	m_bvhDepth = 0;
+	m_bvhWidth = (width == 4 || width == 8) ? width : 2;
+	if (m_objects.empty())
+		return;
 
-	// 从视锥体坐标到世界坐标
-	Matrix invViewMatrix = m_viewMatrix.invert();
-	Vec4f worldPos = invViewMatrix * viewPos;
-	return worldPos;
-}
+	// 每个对象只调用一次虚函数，取出包围盒与中心
+	int objCount = (int)m_objects.size();
+	m_buildPrims.resize(objCount);
+	for (int i = 0; i < objCount; ++i)
+	{
+		BuildPrim& prim = m_buildPrims[i];
+		prim.AA = m_objects[i]->getMinPoint();
+		prim.BB = m_objects[i]->getMaxPoint();
+		prim.center = m_objects[i]->center();
+		prim.objIndex = i;
+	}
 
-void SceneManager::buildBVH(int count)
-{
-	m_cmpFuncs = { cmpx, cmpy, cmpz };
-	//m_pBVHRoot = _buildBVH(0, m_objects.size() - 1, count);
-	m_pBVHRoot = _buildBVHBySAH(0, m_objects.size() - 1, count);
+	// 上层节点在当前线程划分，划分出的子树在线程池中并行构建，完成后按深度优先顺序拼接
+	// 任务只由当前线程提交，线程池中的任务不会等待其他任务
+	count = std::clamp(count, 1, (int)UINT16_MAX); // 叶子节点的对象数量用16位存储
+	// 按核心数划分，idleThreadCount在线程池有任务运行时会减少，可能为0
+	int threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+	m_bvhTaskSize = std::max(minBVHTaskSize, objCount / (threadCount * 4));
+	std::vector<BVHNode> topNodes;
+	std::vector<std::future<BVHSubtree>> tasks;
+	_buildBVHBinned(topNodes, 0, objCount - 1, count, 0, m_bvhDepth, &tasks);
+
+	std::vector<BVHSubtree> subtrees;
+	for (auto& task : tasks)
+	{
+		subtrees.push_back(task.get());
+		m_bvhDepth = std::max(m_bvhDepth, subtrees.back().depth);
+	}
+
+	m_bvhNodes.reserve(objCount * 2);
+	_spliceBVH(topNodes, 0, subtrees);
+	m_bvhNodes.shrink_to_fit();
+
+	// 对象按叶子节点中的顺序重新排列
+	std::vector<IObject*> objects(objCount);
+	for (int i = 0; i < objCount; ++i)
+	{
+		objects[i] = m_objects[m_buildPrims[i].objIndex];
+	}
+	m_objects.swap(objects);
+	m_buildPrims.clear();
+	m_buildPrims.shrink_to_fit();
 
-	int countTris = 0;
-	_countTriangles(countTris, m_pBVHRoot);
-	assert(countTris == m_objects.size());
+	assert(m_bvhDepth <= bvhStackSize);
+	assert(_countTriangles() == m_objects.size());
+
+	_packTriangles();
+
+	// 宽节点由二叉树合并而成，深度不超过二叉树，合并后二叉树不再使用
+	if (m_bvhWidth == 4)
+		_collapseBVH(0, m_bvh4Nodes);
+	else if (m_bvhWidth == 8)
+		_collapseBVH(0, m_bvh8Nodes);
+
+	if (m_bvhWidth != 2)
+	{
+		m_bvhNodes.clear();
+		m_bvhNodes.shrink_to_fit();
+	}
 }
 
 void SceneManager::setMaxDepth(int depth)
@@ -163,264 +236,546 @@ HitResult SceneManager::closestHit(const Ray& ray)
 
 HitResult SceneManager::closestHitByBVH(const Ray& ray)
 {
-	return _closestHitByBVH(ray, m_pBVHRoot);
+	if (m_triangleBlocks.empty())
+		return HitResult();
+
+	// 遍历时只记录距离、重心坐标与图元编号，材质等属性在结束后只对最近的交点获取一次
+	TriangleHit hit;
+	if (m_bvhWidth == 4)
+		_closestHitWide(ray, m_bvh4Nodes, hit);
+	else if (m_bvhWidth == 8)
+		_closestHitWide(ray, m_bvh8Nodes, hit);
+	else
+		_closestHitBinary(ray, hit);
+
+	if (hit.primID < 0)
+		return HitResult();
+
+	return m_objects[hit.primID]->getHitResult(ray, hit.distance, hit.u, hit.v);
 }
 
-TGAColor SceneManager::pathTracing(const Ray& ray, int depth)
+void SceneManager::_closestHitBinary(const Ray& ray, TriangleHit& hit) const
+{
+	// 方向的倒数每条光线只计算一次，方向为负的轴上先访问右孩子，由近到远遍历
+	Vec3f invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+	bool dirNeg[3] = { invDir.x < 0.f, invDir.y < 0.f, invDir.z < 0.f };
+
+	// 用固定大小的栈代替递归，栈中是待访问的较远的孩子
+	int stack[bvhStackSize];
+	int stackSize = 0;
+	int nodeIndex = 0;
+	while (true)
+	{
+		const BVHNode& node = m_bvhNodes[nodeIndex];
+
+		// 与包围盒不相交，或包围盒比已经找到的交点还远，整个子树都可以跳过
+		if (_hitAABB(ray, invDir, node, hit.distance))
+		{
+			if (node.nums > 0)
+			{
+				_hitTriangleArray(ray, node.offset, (node.nums + vfloat::size - 1) / vfloat::size, hit);
+			}
+			else
+			{
+				// 先访问近的孩子，远的孩子入栈
+				int first = nodeIndex + 1;
+				int second = node.offset;
+				if (dirNeg[node.axis])
+					std::swap(first, second);
+
+				stack[stackSize++] = second;
+				nodeIndex = first;
+				continue;
+			}
+		}
+
+		if (stackSize == 0)
+			break;
+
+		nodeIndex = stack[--stackSize];
+	}
+}
+
+template<int N>
+void SceneManager::_closestHitWide(const Ray& ray, const std::vector<WideBVHNode<N>>& nodes, TriangleHit& hit) const
+{
+	using vfloatN = std::conditional_t<N == 4, vfloat4, vfloat8>;
+
+	// 起点与方向的倒数每条光线只计算一次并展开到各分量
+	vfloatN orgX(ray.startPoint.x), orgY(ray.startPoint.y), orgZ(ray.startPoint.z);
+	vfloatN invX(1.0f / ray.direction.x), invY(1.0f / ray.direction.y), invZ(1.0f / ray.direction.z);
+	vfloatN zero(0.f), eps(epsilon);
+
+	// 栈中是待访问的孩子及其包围盒的进入距离，出栈时比已经找到的交点远的直接跳过
+	struct StackEntry
+	{
+		int index;
+		int nums; // 不为0时是叶子
+		float distance;
+	};
+	StackEntry stack[bvhStackSize * (N - 1) + 1];
+	int stackSize = 0;
+	stack[stackSize++] = { 0, 0, 0.f };
+	while (stackSize > 0)
+	{
+		StackEntry entry = stack[--stackSize];
+		if (entry.distance > hit.distance)
+			continue;
+
+		if (entry.nums > 0)
+		{
+			_hitTriangleArray(ray, entry.index, (entry.nums + vfloat::size - 1) / vfloat::size, hit);
+			continue;
+		}
+
+		// 所有孩子的包围盒一起做slab测试
+		const WideBVHNode<N>& node = nodes[entry.index];
+		vfloatN inX = (vfloatN::loadAligned(node.AA[0]) - orgX) * invX;
+		vfloatN inY = (vfloatN::loadAligned(node.AA[1]) - orgY) * invY;
+		vfloatN inZ = (vfloatN::loadAligned(node.AA[2]) - orgZ) * invZ;
+		vfloatN outX = (vfloatN::loadAligned(node.BB[0]) - orgX) * invX;
+		vfloatN outY = (vfloatN::loadAligned(node.BB[1]) - orgY) * invY;
+		vfloatN outZ = (vfloatN::loadAligned(node.BB[2]) - orgZ) * invZ;
+		vfloatN tNear = vmax(vmax(vmin(inX, outX), vmin(inY, outY)), vmax(vmin(inZ, outZ), zero));
+		vfloatN tFar = vmin(vmin(vmax(inX, outX), vmax(inY, outY)), vmin(vmax(inZ, outZ), vfloatN(hit.distance)));
+		int mask = (tNear <= tFar + eps).mask() & ((1 << node.childCount) - 1);
+		if (mask == 0)
+			continue;
+
+		// 相交的孩子按进入距离由远到近入栈，近的先出栈
+		alignas(32) float distance[N];
+		tNear.storeAligned(distance);
+		int first = stackSize;
+		for (int i = 0; i < node.childCount; ++i)
+		{
+			if (!(mask & (1 << i)))
+				continue;
+
+			int pos = stackSize++;
+			while (pos > first && stack[pos - 1].distance < distance[i])
+			{
+				stack[pos] = stack[pos - 1];
+				--pos;
+			}
+			stack[pos] = { node.child[i], node.nums[i], distance[i] };
+		}
+	}
+}
+
+Vec3f SceneManager::pathTracing(const Ray& ray, int depth, Sampler& sampler)
 {
 	if (depth > m_maxDepth)
-		return TGAColor(255, 255, 255);
+		return Vec3f(1.f);
 
 	HitResult res = closestHitByBVH(ray);
 	//HitResult res = closestHit(ray);
 	if (!res.isHit)
-		return TGAColor();
+		return Vec3f();
 
 	// 如果是光源则返回对应颜色
 	if (res.material.isEmissive)
-		return res.material.color;
+		return RenderEngine::colorToRGB(res.material.color);
 
 	// 俄罗斯轮盘赌
-	float r = RenderEngine::randf();
+	float r = sampler.get1D();
 	if (r > russianRouletteChance)
-		return TGAColor();
+		return Vec3f();
 
 	// 生成随机光线
 	Ray randomRay;
 	randomRay.startPoint = res.hitPoint;
-	randomRay.direction = RenderEngine::randomDirection(res.material.normal).normalize();
+	randomRay.direction = RenderEngine::randomDirection(res.material.normal, sampler.get2D());
 
-	TGAColor color;
+	Vec3f color;
 	float cosine = fabs(dot(ray.direction * -1, res.material.normal)); // 光线入射角余弦值，即颜色贡献的权重
 
 	// 根据反射率决定光线最终的方向
-	r = RenderEngine::randf();
+	r = sampler.get1D();
 	if (r < res.material.specularRate)
 	{
 		// 镜面反射
 		randomRay.direction = randomRay.direction * -1;
 		Vec3f ref = RenderEngine::reflect(res.material.normal, ray.direction).normalize();
 		randomRay.direction = RenderEngine::mix(ref, randomRay.direction, res.material.roughness);
-		color = pathTracing(randomRay, depth + 1) * cosine;
+		color = pathTracing(randomRay, depth + 1, sampler) * cosine;
 	}
 	else if (res.material.specularRate <= r && r <= res.material.refractRate)
 	{
 		// 折射
 		Vec3f ref = RenderEngine::refract(ray.direction, res.material.normal, res.material.refractAngle).normalize();
 		randomRay.direction = RenderEngine::mix(ref, randomRay.direction, res.material.refractRoughness);
-		color = pathTracing(randomRay, depth + 1) * cosine;
+		color = pathTracing(randomRay, depth + 1, sampler) * cosine;
 	}
 	else
 	{
 		// 漫反射
 		randomRay.direction = randomRay.direction * -1;
-		color = getTGATexture("diffuse", res.material.texCoords);
-		TGAColor ptColor = pathTracing(randomRay, depth + 1) * cosine;
-		color = ptColor * color;
+		Vec3f albedo = RenderEngine::colorToRGB(getTGATexture("diffuse", res.material.texCoords));
+		Vec3f ptColor = pathTracing(randomRay, depth + 1, sampler) * cosine;
+		color = multiply_elements(ptColor, albedo);
 	}
 
 	return color * (1.f / russianRouletteChance); // 保证总光线强度是一致的
 }
 
-HitResult SceneManager::_closestHitByBVH(const Ray& ray, BVHNode* node)
+int SceneManager::_buildBVHBinned(std::vector<BVHNode>& nodes, int left, int right, int limitCount, int depth, int& maxDepth, std::vector<std::future<BVHSubtree>>* pTasks)
 {
-	if (!node)
-		return HitResult();
+	int count = right - left + 1;
 
-	if (node->nums > 0)
-		return _hitTriangleArray(ray, node->index, node->index + node->nums - 1);
-
-	float d1 = -1, d2 = -1;
-	if (node->left)
-		d1 = _hitAABB(ray, node->left);
-	if (node->right)
-		d2 = _hitAABB(ray, node->right);
-
-	HitResult res1, res2;
-	if (d1 > 0.f)
-		res1 = _closestHitByBVH(ray, node->left);
-	if (d2 > 0.f)
-		res2 = _closestHitByBVH(ray, node->right);
-
-	return res1.distance < res2.distance ? res1 : res2;
-}
-
-SceneManager::BVHNode* SceneManager::_buildBVH(int left, int right, int limitCount)
-{
-	// 递归终止条件
-	if (left > right)
-		return nullptr;
-
-	BVHNode* node = new BVHNode;
-	node->AA = m_objects[left]->getMinPoint();
-	node->BB = m_objects[left]->getMaxPoint();
+	// 子树足够小时提交到线程池，各子树只访问自己范围内的图元，互不干扰
+	// 占位节点的offset为-(任务序号 + 1)
+	if (pTasks && depth > 0 && count > limitCount && count <= m_bvhTaskSize)
+	{
+		auto task = ThreadPool::instance().commit([this, left, right, limitCount, depth]
+			{
+				BVHSubtree subtree;
+				subtree.nodes.reserve((right - left + 1) * 2 / limitCount + 1);
+				_buildBVHBinned(subtree.nodes, left, right, limitCount, depth, subtree.depth, nullptr);
+				return subtree;
+			});
+
+		BVHNode placeholder;
+		placeholder.offset = -(int)pTasks->size() - 1;
+		pTasks->push_back(std::move(task));
+		nodes.push_back(placeholder);
+		return (int)nodes.size() - 1;
+	}
 
-	// 计算包围盒
+	// 计算包围盒与图元中心的范围
+	BVHNode node;
+	node.AA = m_buildPrims[left].AA;
+	node.BB = m_buildPrims[left].BB;
+	Vec3f centerMin = m_buildPrims[left].center;
+	Vec3f centerMax = m_buildPrims[left].center;
 	for (int i = left + 1; i <= right; ++i)
 	{
-		node->AA = RenderEngine::min(node->AA, m_objects[i]->getMinPoint());
-		node->BB = RenderEngine::max(node->BB, m_objects[i]->getMaxPoint());
+		const BuildPrim& prim = m_buildPrims[i];
+		node.AA = RenderEngine::min(node.AA, prim.AA);
+		node.BB = RenderEngine::max(node.BB, prim.BB);
+		centerMin = RenderEngine::min(centerMin, prim.center);
+		centerMax = RenderEngine::max(centerMax, prim.center);
 	}
 
-	if ((right - left + 1) <= limitCount)
+	// 孩子构建时会追加节点，之后只能通过下标访问当前节点
+	maxDepth = std::max(maxDepth, depth + 1);
+	int nodeIndex = (int)nodes.size();
+	nodes.push_back(node);
+
+	// 叶子节点直接返回
+	if (count <= limitCount)
 	{
-		node->index = left;
-		node->nums = right - left + 1;
-		return node;
+		nodes[nodeIndex].offset = left;
+		nodes[nodeIndex].nums = (uint16_t)count;
+		return nodeIndex;
 	}
 
-	// 选择最长的轴进行划分
-	Vec3f diff = node->BB - node->AA;
-	int maxAxis = (diff.x >= diff.y && diff.x >= diff.z) ? 0 : (diff.y >= diff.z ? 1 : 2);
-	std::sort(m_objects.begin() + left, m_objects.begin() + right + 1, m_cmpFuncs[maxAxis]);
+	int axis = 0;
+	int mid = depth < maxSAHDepth ? _splitBySAH(left, right, centerMin, centerMax, axis) : -1;
+
+	// 中心全部重合无法分箱，或者树太深时，沿中心范围最长的轴按中位数划分
+	if (mid < left)
+	{
+		Vec3f diff = centerMax - centerMin;
+		axis = (diff.x >= diff.y && diff.x >= diff.z) ? 0 : (diff.y >= diff.z ? 1 : 2);
+		mid = (left + right) / 2;
+		std::nth_element(m_buildPrims.begin() + left, m_buildPrims.begin() + mid, m_buildPrims.begin() + right + 1, [axis](const BuildPrim& a, const BuildPrim& b)
+			{
+				return a.center[axis] < b.center[axis];
+			});
+	}
 
-	int mid = (left + right) / 2;
-	node->left = _buildBVH(left, mid, limitCount);
-	node->right = _buildBVH(mid + 1, right, limitCount);
+	// 左孩子紧跟在当前节点之后
+	_buildBVHBinned(nodes, left, mid, limitCount, depth + 1, maxDepth, pTasks);
+	int rightIndex = _buildBVHBinned(nodes, mid + 1, right, limitCount, depth + 1, maxDepth, pTasks);
+	nodes[nodeIndex].offset = rightIndex;
+	nodes[nodeIndex].axis = (uint16_t)axis;
 
-	return node;
+	return nodeIndex;
 }
 
-SceneManager::BVHNode* SceneManager::_buildBVHBySAH(int left, int right, int limitCount)
+int SceneManager::_splitBySAH(int left, int right, const Vec3f& centerMin, const Vec3f& centerMax, int& splitAxis)
 {
-	// 递归终止条件
-	if (left > right)
-		return nullptr;
-
-	BVHNode* node = new BVHNode;
-	node->AA = m_objects[left]->getMinPoint();
-	node->BB = m_objects[left]->getMaxPoint();
+	// 图元较少时减少箱子数，统计与累计的开销随之减少
+	int count = right - left + 1;
+	int binCount = std::min(sahBinCount, count);
 
-	// 计算包围盒
-	for (int i = left + 1; i <= right; ++i)
+	// 中心在某个轴上没有范围时不在这个轴上划分
+	Vec3f scale;
+	for (int axis = 0; axis < 3; ++axis)
 	{
-		node->AA = RenderEngine::min(node->AA, m_objects[i]->getMinPoint());
-		node->BB = RenderEngine::max(node->BB, m_objects[i]->getMaxPoint());
+		float extent = centerMax[axis] - centerMin[axis];
+		scale[axis] = extent > 0.f ? binCount / extent : 0.f;
 	}
 
-	// 叶子节点直接返回
-	if ((right - left + 1) <= limitCount)
+	// 一次遍历同时统计三个轴上每个箱子的包围盒与图元数，三个轴手工展开避免按下标取分量
+	SAHBin bins[3][sahBinCount];
+	auto addToBin = [](SAHBin& bin, const BuildPrim& prim)
+	{
+		bin.AA = RenderEngine::min(bin.AA, prim.AA);
+		bin.BB = RenderEngine::max(bin.BB, prim.BB);
+		++bin.count;
+	};
+	for (int i = left; i <= right; ++i)
 	{
-		node->index = left;
-		node->nums = right - left + 1;
-		return node;
+		const BuildPrim& prim = m_buildPrims[i];
+		Vec3f pos = multiply_elements(prim.center - centerMin, scale);
+		addToBin(bins[0][std::min((int)pos.x, binCount - 1)], prim);
+		addToBin(bins[1][std::min((int)pos.y, binCount - 1)], prim);
+		addToBin(bins[2][std::min((int)pos.z, binCount - 1)], prim);
 	}
 
-	// 采取SAH策略选择代价最小的轴进行划分
-	float finalCost = FLT_MAX;
-	int finalAxis = 0; // 记录最终选择的轴
-	int finalSplit = (left + right) / 2; // 记录最终的划分位置
-
-	// 遍历每个轴获取到最小的代价
+	float bestCost = FLT_MAX;
+	int bestAxis = -1;
+	int bestBin = 0;
 	for (int axis = 0; axis < 3; ++axis)
 	{
-		// 按轴排序
-		std::sort(m_objects.begin() + left, m_objects.begin() + right + 1, m_cmpFuncs[axis]);
-
-		// 构造左节点前缀，表示left->i的区间的最大值和最小值
-		std::vector<Vec3f> preLeftMin(right - left + 1, FLT_MAX);
-		std::vector<Vec3f> preLeftMax(right - left + 1, -FLT_MAX);
-		preLeftMin[0] = m_objects[left]->getMinPoint();
-		preLeftMax[0] = m_objects[left]->getMaxPoint();
-		for (int l = left + 1; l <= right; ++l)
-		{
-			preLeftMin[l - left] =RenderEngine::min(preLeftMin[l - left - 1], m_objects[l]->getMinPoint());
-			preLeftMax[l - left] = RenderEngine::max(preLeftMax[l - left - 1], m_objects[l]->getMaxPoint());
-		}
+		if (scale[axis] == 0.f)
+			continue;
 
-		// 构造右节点前缀，表示right->i区间的最大值和最小值
-		std::vector<Vec3f> preRightMin(right - left + 1, FLT_MAX);
-		std::vector<Vec3f> preRightMax(right - left + 1, -FLT_MAX);
-		preRightMin[right - left] = m_objects[right]->getMinPoint();
-		preRightMax[right - left] = m_objects[right]->getMaxPoint();
-		for (int r = right - 1; r >= left; --r)
+		// 从右向左累计，rightCost[i]为第i个边界右侧所有箱子的代价
+		float rightCost[sahBinCount - 1];
+		SAHBin rightBin;
+		for (int i = binCount - 1; i > 0; --i)
 		{
-			preRightMin[r - left] = RenderEngine::min(preRightMin[r - left + 1], m_objects[r]->getMinPoint());
-			preRightMax[r - left] = RenderEngine::max(preRightMax[r - left + 1], m_objects[r]->getMaxPoint());
+			rightBin.AA = RenderEngine::min(rightBin.AA, bins[axis][i].AA);
+			rightBin.BB = RenderEngine::max(rightBin.BB, bins[axis][i].BB);
+			rightBin.count += bins[axis][i].count;
+			rightCost[i - 1] = rightBin.count > 0 ? surfaceArea(rightBin.AA, rightBin.BB) * rightBin.count : 0.f;
 		}
 
-		// 遍历寻找分割
-		float cost = FLT_MAX;
-		int split = left;
-		for (int partition = left; partition < right; ++partition)
+		// 从左向右累计，两侧都有图元的边界才是有效的划分
+		SAHBin leftBin;
+		for (int i = 0; i < binCount - 1; ++i)
 		{
-			// 左边包围盒
-			Vec3f leftMin = preLeftMin[partition - left];
-			Vec3f leftMax = preLeftMax[partition - left];
-			Vec3f lenLeft = leftMax - leftMin;
-			float leftSurfaceArea = 2 * (lenLeft.x * lenLeft.y + lenLeft.x * lenLeft.z + lenLeft.y * lenLeft.z);
-			float leftCost = leftSurfaceArea * (partition - left + 1);
-
-			// 右边包围盒
-			Vec3f rightMin = preRightMin[partition - left + 1];
-			Vec3f rightMax = preRightMax[partition - left + 1];
-			Vec3f lenRight = rightMax - rightMin;
-			float rightSurfaceArea = 2 * (lenRight.x * lenRight.y + lenRight.x * lenRight.z + lenRight.y * lenRight.z);
-			float rightCost = rightSurfaceArea * (right - partition);
-
-			// 计算每个轴最小的代价
-			float totalCost = leftCost + rightCost;
-			if (totalCost < cost)
+			leftBin.AA = RenderEngine::min(leftBin.AA, bins[axis][i].AA);
+			leftBin.BB = RenderEngine::max(leftBin.BB, bins[axis][i].BB);
+			leftBin.count += bins[axis][i].count;
+			if (leftBin.count == 0 || leftBin.count == count)
+				continue;
+
+			float cost = surfaceArea(leftBin.AA, leftBin.BB) * leftBin.count + rightCost[i];
+			if (cost < bestCost)
 			{
-				cost = totalCost;
-				split = partition;
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = i;
 			}
 		}
+	}
+
+	if (bestAxis < 0)
+		return -1;
+
+	// 按选中的边界把图元分到两侧，落箱的算式与统计时一致
+	auto itemMid = std::partition(m_buildPrims.begin() + left, m_buildPrims.begin() + right + 1, [&](const BuildPrim& prim)
+		{
+			return std::min((int)((prim.center[bestAxis] - centerMin[bestAxis]) * scale[bestAxis]), binCount - 1) <= bestBin;
+		});
 
-		// 更新最终的最小代价
-		if (cost < finalCost)
+	splitAxis = bestAxis;
+	return (int)(itemMid - m_buildPrims.begin()) - 1;
+}
+
+int SceneManager::_spliceBVH(const std::vector<BVHNode>& topNodes, int index, std::vector<BVHSubtree>& subtrees)
+{
+	const BVHNode& node = topNodes[index];
+
+	// 占位节点换成整棵子树，子树内部节点的右孩子下标加上子树的起始位置
+	if (node.nums == 0 && node.offset < 0)
+	{
+		int base = (int)m_bvhNodes.size();
+		for (BVHNode subNode : subtrees[-node.offset - 1].nodes)
 		{
-			finalCost = cost;
-			finalAxis = axis;
-			finalSplit = split;
+			if (subNode.nums == 0)
+				subNode.offset += base;
+			m_bvhNodes.push_back(subNode);
 		}
+		return base;
 	}
 
-	// 根据最终的轴和划分位置进行排序
-	assert(finalAxis >= 0 && finalAxis < 3);
-	std::sort(m_objects.begin() + left, m_objects.begin() + right + 1, m_cmpFuncs[finalAxis]);
-	node->left = _buildBVHBySAH(left, finalSplit, limitCount);
-	node->right = _buildBVHBySAH(finalSplit + 1, right, limitCount);
+	int nodeIndex = (int)m_bvhNodes.size();
+	m_bvhNodes.push_back(node);
+	if (node.nums == 0)
+	{
+		_spliceBVH(topNodes, index + 1, subtrees);
+		int rightIndex = _spliceBVH(topNodes, node.offset, subtrees);
+		m_bvhNodes[nodeIndex].offset = rightIndex;
+	}
 
-	return node;
+	return nodeIndex;
 }
 
-float SceneManager::_hitAABB(const Ray& ray, const BVHNode* node)
+bool SceneManager::_hitAABB(const Ray& ray, const Vec3f& invDir, const BVHNode& node, float tMax) const
 {
-	// 计算方向的倒数
-	Vec3f invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
-
 	// 计算进入点和出去点在每个轴上的值
-	Vec3f in = multiply_elements(node->AA - ray.startPoint, invDir);
-	Vec3f out = multiply_elements(node->BB - ray.startPoint, invDir);
+	Vec3f in = multiply_elements(node.AA - ray.startPoint, invDir);
+	Vec3f out = multiply_elements(node.BB - ray.startPoint, invDir);
 
 	// 光线的方向不确定
-	Vec3f tMin = RenderEngine::min(in, out);
-	Vec3f tMax = RenderEngine::max(in, out);
+	Vec3f tNear = RenderEngine::min(in, out);
+	Vec3f tFar = RenderEngine::max(in, out);
+
+	// 与光线的有效范围[0, tMax]求交，相切时t0 == t1也算相交
+	float t0 = std::max({ tNear.x, tNear.y, tNear.z, 0.f });
+	float t1 = std::min({ tFar.x, tFar.y, tFar.z, tMax });
+	return t0 <= t1 + epsilon;
+}
+
+template<int N>
+int SceneManager::_collapseBVH(int index, std::vector<WideBVHNode<N>>& nodes) const
+{
+	// 从当前节点开始，每次把表面积最大的内部节点换成它的两个孩子
+	int children[N] = { index };
+	int childCount = 1;
+	while (childCount < N)
+	{
+		int expand = -1;
+		float maxArea = -1.f;
+		for (int i = 0; i < childCount; ++i)
+		{
+			const BVHNode& node = m_bvhNodes[children[i]];
+			if (node.nums > 0)
+				continue;
 
-	float t0 = std::max(tMin.x, std::max(tMin.y, tMin.z));
-	float t1 = std::min(tMax.x, std::min(tMax.y, tMax.z));
+			float area = surfaceArea(node.AA, node.BB);
+			if (area > maxArea)
+			{
+				maxArea = area;
+				expand = i;
+			}
+		}
 
-	// 处理相切情况，即 t1 - t0 = 0
-	if (std::abs(t1 - t0) < epsilon)
-		return t0;
+		if (expand < 0)
+			break;
+
+		int nodeIndex = children[expand];
+		children[expand] = nodeIndex + 1;
+		children[childCount++] = m_bvhNodes[nodeIndex].offset;
+	}
 
-	return (t1 >= t0) ? ((t0 > 0.f) ? t0 : t1) : -1;
+	int wideIndex = (int)nodes.size();
+	nodes.emplace_back();
+	nodes[wideIndex].childCount = childCount;
+	for (int i = 0; i < N; ++i)
+	{
+		// 空位的包围盒不会被使用，遍历时按childCount屏蔽
+		const BVHNode* pNode = i < childCount ? &m_bvhNodes[children[i]] : nullptr;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			nodes[wideIndex].AA[axis][i] = pNode ? pNode->AA[axis] : 0.f;
+			nodes[wideIndex].BB[axis][i] = pNode ? pNode->BB[axis] : 0.f;
+		}
+		nodes[wideIndex].child[i] = pNode ? pNode->offset : -1;
+		nodes[wideIndex].nums[i] = pNode ? pNode->nums : 0;
+	}
+
+	// 递归会向nodes追加节点，只能按下标回写
+	for (int i = 0; i < childCount; ++i)
+	{
+		if (m_bvhNodes[children[i]].nums == 0)
+		{
+			int childIndex = _collapseBVH(children[i], nodes);
+			nodes[wideIndex].child[i] = childIndex;
+		}
+	}
+
+	return wideIndex;
 }
 
-HitResult SceneManager::_hitTriangleArray(const Ray& ray, const int left, const int right)
+void SceneManager::_packTriangles()
 {
-	HitResult res;
-
-	HitResult tmp;
-	for (int i = left; i <= right; ++i)
+	m_triangleBlocks.reserve((m_objects.size() + vfloat::size - 1) / vfloat::size + m_bvhNodes.size() / 2);
+	for (BVHNode& node : m_bvhNodes)
 	{
-		tmp = m_objects[i]->intersect(ray);
-		if (tmp.isHit && tmp.distance < res.distance)
-			res = tmp;
+		if (node.nums == 0)
+			continue;
+
+		// 每个叶子节点从新的块开始，块内按对象在m_objects中的顺序存放
+		int firstObj = node.offset;
+		node.offset = (int)m_triangleBlocks.size();
+		for (int i = 0; i < node.nums; i += vfloat::size)
+		{
+			TriangleBlock& block = m_triangleBlocks.emplace_back();
+			for (int lane = 0; lane < vfloat::size; ++lane)
+			{
+				if (i + lane >= node.nums)
+				{
+					block.primID[lane] = -1;
+					continue;
+				}
+
+				int objIndex = firstObj + i + lane;
+				const Vec3f* pVertex = m_objects[objIndex]->vertex();
+				Vec3f edge1 = pVertex[1] - pVertex[0];
+				Vec3f edge2 = pVertex[2] - pVertex[0];
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					block.v0[axis][lane] = pVertex[0][axis];
+					block.edge1[axis][lane] = edge1[axis];
+					block.edge2[axis][lane] = edge2[axis];
+				}
+				block.primID[lane] = objIndex;
+			}
+		}
 	}
+}
 
-	return res;
+void SceneManager::_hitTriangleArray(const Ray& ray, int firstBlock, int blockCount, TriangleHit& hit) const
+{
+	vfloat orgX(ray.startPoint.x), orgY(ray.startPoint.y), orgZ(ray.startPoint.z);
+	vfloat dirX(ray.direction.x), dirY(ray.direction.y), dirZ(ray.direction.z);
+	vfloat zero(0.f), one(1.f), eps(triangleEpsilon);
+
+	for (int b = firstBlock; b < firstBlock + blockCount; ++b)
+	{
+		const TriangleBlock& block = m_triangleBlocks[b];
+		vfloat e1x = vfloat::loadAligned(block.edge1[0]);
+		vfloat e1y = vfloat::loadAligned(block.edge1[1]);
+		vfloat e1z = vfloat::loadAligned(block.edge1[2]);
+		vfloat e2x = vfloat::loadAligned(block.edge2[0]);
+		vfloat e2y = vfloat::loadAligned(block.edge2[1]);
+		vfloat e2z = vfloat::loadAligned(block.edge2[2]);
+
+		// Möller–Trumbore，pvec = dir x edge2，det = edge1 · pvec
+		vfloat px = dirY * e2z - dirZ * e2y;
+		vfloat py = dirZ * e2x - dirX * e2z;
+		vfloat pz = dirX * e2y - dirY * e2x;
+		vfloat det = e1x * px + e1y * py + e1z * pz;
+		vfloat invDet = one / det;
+
+		// tvec = org - v0，qvec = tvec x edge1
+		vfloat tx = orgX - vfloat::loadAligned(block.v0[0]);
+		vfloat ty = orgY - vfloat::loadAligned(block.v0[1]);
+		vfloat tz = orgZ - vfloat::loadAligned(block.v0[2]);
+		vfloat u = (tx * px + ty * py + tz * pz) * invDet;
+		vfloat qx = ty * e1z - tz * e1y;
+		vfloat qy = tz * e1x - tx * e1z;
+		vfloat qz = tx * e1y - ty * e1x;
+		vfloat v = (dirX * qx + dirY * qy + dirZ * qz) * invDet;
+		vfloat t = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+
+		// 与光线平行（包括空位）的三角形行列式为0，比已经找到的交点远的也不需要
+		vfloat valid = ((det > eps) | (det < zero - eps)) & (u >= zero) & (v >= zero) & (u + v <= one)
+			& (t >= eps) & (t < vfloat(hit.distance));
+		int mask = valid.mask();
+		if (mask == 0)
+			continue;
+
+		alignas(32) float ts[vfloat::size], us[vfloat::size], vs[vfloat::size];
+		t.storeAligned(ts);
+		u.storeAligned(us);
+		v.storeAligned(vs);
+		for (int lane = 0; lane < vfloat::size; ++lane)
+		{
+			if ((mask & (1 << lane)) && ts[lane] < hit.distance)
+			{
+				hit.distance = ts[lane];
+				hit.u = us[lane];
+				hit.v = vs[lane];
+				hit.primID = block.primID[lane];
+			}
+		}
+	}
 }
 
 void SceneManager::_transCoords(Vec3f* vec)
@@ -434,30 +789,13 @@ void SceneManager::_transCoords(Vec3f* vec)
 	}
 }
 
-void SceneManager::_countTriangles(int& totalTriangles, const BVHNode* node)
+int SceneManager::_countTriangles() const
 {
-	if (node->nums > 0)  // 叶子节点
-	{
-		totalTriangles += node->nums;  // 累加叶子节点中的三角形数量
-	}
-	else  // 递归处理子节点
+	// 累加叶子节点中的三角形数量
+	int totalTriangles = 0;
+	for (const BVHNode& node : m_bvhNodes)
 	{
-		if (node->left)
-			_countTriangles(totalTriangles, node->left);
-		if (node->right)
-			_countTriangles(totalTriangles, node->right);
+		totalTriangles += node.nums;
 	}
-}
-
-void SceneManager::_deleteBVH(BVHNode* node)
-{
-	if (!node)
-		return;
-
-	if (node->left)
-		_deleteBVH(node->left);
-	if (node->right)
-		_deleteBVH(node->right);
-
-	delete node;
+	return totalTriangles;
 }
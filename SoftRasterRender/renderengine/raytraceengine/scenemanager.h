@@ -2,13 +2,17 @@
 #define __SCENEMANAGER__H__
 
 #include <vector>
+#include <future>
 
 #include "iobject.h"
 #include "tgaimage.h"
+#include "texture.h"
+#include "simd.h"
+#include "sampler.h"
 
 class SceneManager
 {
-	using TextureContainer = std::unordered_map<std::string, std::unique_ptr<TGAImage>>;
+	using TextureContainer = std::unordered_map<std::string, std::unique_ptr<Texture>>;
 public:
 	SceneManager() = default;
 	~SceneManager();
@@ -26,13 +30,14 @@ public:
 	void setProMatrix(const Matrix& pro);
 	void setViewportMatrix(const Matrix& viewport);
 
+	Matrix getViewMatrix() const;
+	Matrix getProMatrix() const;
 	Matrix getViewportMatrix();
 
 	TGAColor getTGATexture(const std::string& texName, const Vec2f& uv);
 
-	Vec3f projTransform2World(const Vec4f& clipPos);
-
-	void buildBVH(int count);
+	// width为4或8时二叉树合并为对应宽度的节点，其他值保持二叉树
+	void buildBVH(int count, int width = 2);
 
 	void setMaxDepth(int depth);
 
@@ -42,45 +47,108 @@ public:
 	// 采用BVH加速结构求交
 	HitResult closestHitByBVH(const Ray& ray);
 
-	TGAColor pathTracing(const Ray& ray, int depth);
+	// 随机数都从sampler中按维度顺序获取，返回线性的HDR颜色，不做截断
+	Vec3f pathTracing(const Ray& ray, int depth, Sampler& sampler);
 
 private:
-	struct BVHNode
+	// 线性化的BVH节点，按深度优先的顺序连续存放，左孩子紧跟在父节点之后，只记录右孩子的下标
+	// 32字节对齐，一个节点正好占半条缓存行
+	struct alignas(32) BVHNode
 	{
-		BVHNode* left = nullptr;
-		BVHNode* right = nullptr;
-
-		int index = -1; // 当前节点包含的对象开始索引
-		int nums = 0;   // 当前节点包含的对象数量，nums不为0时表示叶子节点
-
 		// 包围盒
 		Vec3f AA; // 左下
+		int offset = -1; // 叶子节点为第一个三角形块的下标，内部节点为右孩子的下标
 		Vec3f BB; // 右上
+		uint16_t nums = 0; // 当前节点包含的三角形数量，nums不为0时表示叶子节点
+		uint16_t axis = 0; // 内部节点的划分轴，遍历时据此决定先访问哪个孩子
 	};
+	static_assert(sizeof(BVHNode) == 32, "BVHNode must stay 32 bytes");
 
-	HitResult _closestHitByBVH(const Ray& ray, BVHNode* node);
+	// 由二叉树合并成的宽节点，N个孩子的包围盒按SoA存放，一次SIMD测试所有孩子
+	// 孩子依次存放在前childCount个位置，nums不为0的孩子是叶子，child为第一个三角形块的下标，否则为宽节点的下标
+	template<int N>
+	struct alignas(32) WideBVHNode
+	{
+		float AA[3][N];
+		float BB[3][N];
+		int child[N];
+		uint16_t nums[N];
+		int childCount = 0;
+	};
 
-	// 构建BVH树
-	BVHNode* _buildBVH(int left, int right, int limitCount = 8);
+	// 叶子节点中的三角形按vfloat::size个一组打包成SoA块，存第一个顶点与两条边，用SIMD同时求交
+	// 不满一组时空位的两条边为0，行列式为0，永远不会命中
+	struct alignas(32) TriangleBlock
+	{
+		float v0[3][vfloat::size];
+		float edge1[3][vfloat::size];
+		float edge2[3][vfloat::size];
+		int primID[vfloat::size]; // 在m_objects中的下标
+	};
 
-	/*SVH构建BVH树
+	// 遍历过程中的最近交点，只记录距离、重心坐标与图元编号
+	struct TriangleHit
+	{
+		float distance = FLT_MAX;
+		float u = 0.f;
+		float v = 0.f;
+		int primID = -1;
+	};
+
+	// 构建BVH时的图元，包围盒与中心预先计算一次，构建过程中不再调用虚函数
+	struct BuildPrim
+	{
+		Vec3f AA;
+		Vec3f BB;
+		Vec3f center;
+		int objIndex = 0; // 在m_objects中的下标
+	};
+
+	// 在线程池中构建的子树，内部节点记录的右孩子下标相对于子树自身
+	struct BVHSubtree
+	{
+		std::vector<BVHNode> nodes;
+		int depth = 0;
+	};
+
+	/*分箱SAH构建BVH树
 	* 查找左盒子的 n1 个三角形需要花费 t * n1 的时间（其中 t 为常数）
 	* 查找右盒子的 n2 个三角形需要花费 t * n2 的时间
 	* 假设光线有 p1 的概率击中左盒子，有 p2 的概率击中右盒子，这里用表面积代替，成正相关
 	* 最终的代价为 cost = p1 * n1 + p2 * n2 （这里省略了常数 T）
+	* 候选划分只取图元中心范围内等分的箱子边界，每个节点只需遍历一次图元，不排序
+	* 节点按深度优先顺序追加到nodes，返回节点的下标，maxDepth记录树的深度
+	* pTasks不为空时，较小的子树提交到线程池构建，先留一个占位节点，之后由_spliceBVH替换
 	*/
-	BVHNode* _buildBVHBySAH(int left, int right, int limitCount = 8);
+	int _buildBVHBinned(std::vector<BVHNode>& nodes, int left, int right, int limitCount, int depth, int& maxDepth, std::vector<std::future<BVHSubtree>>* pTasks);
+
+	// 在[left, right]内寻找SAH代价最小的箱子边界并划分图元，返回左半部分的最后一个下标，无法划分时返回-1
+	int _splitBySAH(int left, int right, const Vec3f& centerMin, const Vec3f& centerMax, int& splitAxis);
+
+	// 把上层节点与各子树按深度优先顺序拼接到m_bvhNodes，返回节点在m_bvhNodes中的下标
+	int _spliceBVH(const std::vector<BVHNode>& topNodes, int index, std::vector<BVHSubtree>& subtrees);
+
+	// 把以index为根的二叉子树合并为宽节点，每次展开表面积最大的内部孩子，直到孩子数达到N，返回宽节点的下标
+	template<int N>
+	int _collapseBVH(int index, std::vector<WideBVHNode<N>>& nodes) const;
+
+	// 遍历二叉树与宽节点的BVH，比hit更近时更新hit
+	void _closestHitBinary(const Ray& ray, TriangleHit& hit) const;
+	template<int N>
+	void _closestHitWide(const Ray& ray, const std::vector<WideBVHNode<N>>& nodes, TriangleHit& hit) const;
+
+	// 光线在[0, tMax]范围内是否与包围盒相交，invDir为光线方向的倒数，每条光线只计算一次
+	bool _hitAABB(const Ray& ray, const Vec3f& invDir, const BVHNode& node, float tMax) const;
 
-	// 存在三个返回值，分别表示未相交(-1)、相交(t0)、相交且在包围盒内(t1)，大于0表示相交
-	float _hitAABB(const Ray& ray, const BVHNode* node);
+	// 叶子节点的三角形按顺序打包成三角形块，叶子节点的offset改为第一个块的下标
+	void _packTriangles();
 
-	// 遍历叶子节点中的三角形，返回距离最近那一个的交点结果
-	HitResult _hitTriangleArray(const Ray& ray, const int left, const int right);
+	// 遍历叶子节点的三角形块，比hit更近时更新hit
+	void _hitTriangleArray(const Ray& ray, int firstBlock, int blockCount, TriangleHit& hit) const;
 
 private:
 	void _transCoords(Vec3f* vec);
-	void _countTriangles(int& totalTriangles, const BVHNode* node);
-	void _deleteBVH(BVHNode* node);
+	int _countTriangles() const;
 
 private:
 	std::vector<IObject*> m_objects; // 场景中的物体，负责对象的生命周期
@@ -97,10 +165,16 @@ private:
 
 	int m_maxDepth = 5; // 最大递归深度
 
-	BVHNode* m_pBVHRoot = nullptr; // BVH根节点
+	std::vector<BVHNode> m_bvhNodes; // BVH节点，下标0为根节点，合并为宽节点后清空
+	std::vector<WideBVHNode<4>> m_bvh4Nodes; // 4路宽节点，下标0为根节点
+	std::vector<WideBVHNode<8>> m_bvh8Nodes; // 8路宽节点，下标0为根节点
+	int m_bvhWidth = 2; // 遍历时使用的节点宽度
+	std::vector<TriangleBlock> m_triangleBlocks; // 叶子节点中的三角形，按叶子节点的顺序存放
+	int m_bvhDepth = 0; // BVH的深度，遍历栈的大小要能容纳
 
-	// 排序函数0,1,2分别表示x,y,z轴
-	std::array<std::function<bool(IObject*, IObject*)>, 3> m_cmpFuncs;
+	// 只在构建BVH期间使用
+	std::vector<BuildPrim> m_buildPrims;
+	int m_bvhTaskSize = 0; // 图元数不超过它的子树提交到线程池构建
 
 	TextureContainer m_texs;
 };
@@ -154,65 +154,59 @@ void TriangleObj::setVertexAttr(const VertexAttr type, const Vec2f* pVertexAttr)
 }
 
 HitResult TriangleObj::intersect(const Ray& ray)
+{
+	// Möller–Trumbore，与SceneManager中打包三角形的SIMD求交使用相同的判定
+	Vec3f edge1 = m_pVertexs[1] - m_pVertexs[0];
+	Vec3f edge2 = m_pVertexs[2] - m_pVertexs[0];
+	Vec3f pvec = cross(ray.direction, edge2);
+	float det = dot(edge1, pvec);
+
+	// 如果视线和三角形平行则不计算，正反两面都可以命中
+	if (fabs(det) < epsilon)
+		return HitResult();
+
+	float invDet = 1.f / det;
+	Vec3f tvec = ray.startPoint - m_pVertexs[0];
+	float u = dot(tvec, pvec) * invDet;
+	Vec3f qvec = cross(tvec, edge1);
+	float v = dot(ray.direction, qvec) * invDet;
+	float t = dot(edge2, qvec) * invDet;
+
+	// 判断是否在三角形内，以及交点是否在光线的正方向
+	if (u < 0.f || v < 0.f || u + v > 1.f || t < epsilon)
+		return HitResult();
+
+	return getHitResult(ray, t, u, v);
+}
+
+HitResult TriangleObj::getHitResult(const Ray& ray, float distance, float u, float v)
 {
 	HitResult res;
 
-	Vec3f rayStart = ray.startPoint;
-	Vec3f rayDirection = ray.direction;
 	Vec3f normal = cross(m_pVertexs[1] - m_pVertexs[0], m_pVertexs[2] - m_pVertexs[0]).normalize();
 
 	// 调整法向量
-	if (dot(normal, rayDirection) > 0.0f)
+	if (dot(normal, ray.direction) > 0.0f)
 		normal = normal * -1;
 
-	// 如果视线和三角形平行，即与法线垂直则不计算
-	if (fabs(dot(normal, rayDirection)) < epsilon)
-		return res;
-
-	// 获取距离并判断方向，如果在背面则不计算
-	float t = (dot(normal, m_pVertexs[0]) - dot(rayStart, normal)) / dot(rayDirection, normal);
-	if (t < epsilon)
-		return res;
-
-	Vec3f hitPoint = rayStart + rayDirection * t; // 求交点
-
-	// 判断是否在三角形内
-	Vec3f barycentric = _getBarycentric(hitPoint);
-	if (barycentric.x < 0 || barycentric.y < 0 || barycentric.z < 0)
-		return res;
+	Vec3f barycentric(1.f - u - v, u, v);
 
 	// 插值得到法线
 	/*normal = (m_pNormals[0] * barycentric.x + m_pNormals[1] * barycentric.y + m_pNormals[2] * barycentric.z).normalize();
-	if (dot(normal, rayDirection) > 0.0f)
+	if (dot(normal, ray.direction) > 0.0f)
 		normal = normal * -1;*/
 
-	// 插值获取纹理坐标
-	Vec2f texCoords = (m_pTexCoords[0] * barycentric.x + m_pTexCoords[1] * barycentric.y + m_pTexCoords[2] * barycentric.z);
+	// 插值获取纹理坐标，光源等没有设置纹理坐标的三角形不插值
+	if (m_pTexCoords)
+		res.material.texCoords = (m_pTexCoords[0] * barycentric.x + m_pTexCoords[1] * barycentric.y + m_pTexCoords[2] * barycentric.z);
 
 	res.isHit = true;
-	res.distance = t;
-	res.hitPoint = hitPoint;
+	res.distance = distance;
+	res.hitPoint = ray.startPoint + ray.direction * distance;
 	res.material.normal = normal;
-	res.material.texCoords = texCoords;
 	res.material.isEmissive = m_material.isEmissive;
 	res.material.color = m_material.color;
 
-	assert(res.material.isEmissive == false);
-
 	return res;
 }
 
-Vec3f TriangleObj::_getBarycentric(const Vec3f& point)
-{
-	Vec3f PA = m_pVertexs[0] - point;
-	Vec3f AB = m_pVertexs[1] - m_pVertexs[0];
-	Vec3f AC = m_pVertexs[2] - m_pVertexs[0];
-
-	// 通过叉乘获取重心坐标, 对应[area, u, v]，表示面积
-	Vec3f barycentric = cross(Vec3f(PA.x, AB.x, AC.x), Vec3f(PA.y, AB.y, AC.y));
-	if ((barycentric.x - 0.f) < epsilon)
-		return Vec3f(-1, 1, 1); // 等于0表示退化为直线，为无效的三角形
-
-	// 转为1-u-v, u, v的标准格式，即比例模式
-	return Vec3f(1.f - (barycentric.y + barycentric.z) / barycentric.x, barycentric.y / barycentric.x, barycentric.z / barycentric.x);
-}
@@ -24,12 +24,10 @@ public:
     void setVertexAttr(const VertexAttr type, const Vec2f* pVertexAttr) override;
 
     virtual HitResult intersect(const Ray& ray) override;
+    HitResult getHitResult(const Ray& ray, float distance, float u, float v) override;
 
     Material& getMaterial() override { return m_material; }
 
-private:
-    Vec3f _getBarycentric(const Vec3f& point);
-
 private:
     std::unique_ptr<Vec3f[]> m_pVertexs; // 三角形的三个顶点
     std::unique_ptr<Vec3f[]> m_pNormals; // 三角形各顶点的法线
@@ -0,0 +1,62 @@
+﻿#ifndef __TEXTURE_H__
+#define __TEXTURE_H__
+
+#include <vector>
+#include <cstdint>
+
+#include "tgaimage.h"
+
+enum class TextureFilter : int8_t
+{
+	Nearest = 0, // 最近的mip层级，最近的纹素
+	Bilinear, // 最近的mip层级，双线性插值
+	Trilinear // 相邻两个mip层级分别双线性插值后再插值
+};
+
+// 由TGAImage构建的只读纹理，供光栅化与光线追踪引擎采样
+// 构建时预先生成盒式滤波的mip链，每一层按8x8的块存放，块内按Morton顺序排列
+// 相邻纹素在内存中也相邻，双线性采样的四个纹素大多落在同一个缓存行内
+// 纹理坐标超出[0, 1]时取边缘纹素
+class Texture
+{
+public:
+	Texture() = default;
+	explicit Texture(TGAImage& img);
+
+	int width() const;
+	int height() const;
+	int levelCount() const;
+
+	// 根据纹理坐标在屏幕空间x、y方向上的差分计算mip层级
+	float computeLod(const Vec2f& ddx, const Vec2f& ddy) const;
+
+	// 在指定的mip层级上采样
+	TGAColor sample(const Vec2f& uv, float lod = 0.f, TextureFilter filter = TextureFilter::Nearest) const;
+	// 由差分计算mip层级后采样
+	TGAColor sampleGrad(const Vec2f& uv, const Vec2f& ddx, const Vec2f& ddy, TextureFilter filter = TextureFilter::Trilinear) const;
+
+private:
+	// 块的边长为 1 << tileShift
+	static constexpr int tileShift = 3;
+
+	struct MipLevel
+	{
+		int width = 0;
+		int height = 0;
+		int tileCols = 0;
+		std::vector<uint32_t> texels; // 按块存放，每个纹素为4个字节，与TGAColor的字节顺序一致
+	};
+
+	static uint32_t _fetch(const MipLevel& level, int x, int y);
+	static void _store(MipLevel& level, int x, int y, uint32_t texel);
+
+	void _nearest(const MipLevel& level, const Vec2f& uv, float* out) const;
+	void _bilinear(const MipLevel& level, const Vec2f& uv, float* out) const;
+	TGAColor _toColor(const float* bgra) const;
+
+private:
+	std::vector<MipLevel> m_levels;
+	int m_bytespp = 0;
+};
+
+#endif // !__TEXTURE_H__
@@ -156,6 +156,8 @@ public:
 	int get_bytespp();
 
 	const unsigned char* buffer();
+	// 可写的像素数据，行优先，每个像素get_bytespp()个字节
+	unsigned char* pixels();
 
 	void clear();
 
@@ -0,0 +1,213 @@
+﻿#include "stdafx.h"
+#include "texture.h"
+
+namespace
+{
+	// 把低3位的比特间隔展开，用于块内的Morton编码
+	int spreadBits(int v)
+	{
+		return (v & 1) | ((v & 2) << 1) | ((v & 4) << 2);
+	}
+
+	uint32_t packTexel(const unsigned char* bgra)
+	{
+		return (uint32_t)bgra[0] | ((uint32_t)bgra[1] << 8) | ((uint32_t)bgra[2] << 16) | ((uint32_t)bgra[3] << 24);
+	}
+
+	void unpackTexel(uint32_t texel, float* bgra)
+	{
+		for (int i = 0; i < 4; ++i)
+		{
+			bgra[i] = (float)((texel >> (i * 8)) & 0xff);
+		}
+	}
+}
+
+Texture::Texture(TGAImage& img)
+	: m_bytespp(img.get_bytespp())
+{
+	if (img.get_width() <= 0 || img.get_height() <= 0)
+		return;
+
+	auto createLevel = [](int width, int height)
+		{
+			constexpr int tileSize = 1 << tileShift;
+			MipLevel level;
+			level.width = width;
+			level.height = height;
+			level.tileCols = (width + tileSize - 1) >> tileShift;
+			int tileRows = (height + tileSize - 1) >> tileShift;
+			level.texels.resize(level.tileCols * tileRows << (tileShift * 2));
+			return level;
+		};
+
+	// 第0层直接拷贝原图
+	MipLevel base = createLevel(img.get_width(), img.get_height());
+	for (int y = 0; y < base.height; ++y)
+	{
+		for (int x = 0; x < base.width; ++x)
+		{
+			_store(base, x, y, packTexel(img.get(x, y).m_bgra));
+		}
+	}
+	m_levels.push_back(std::move(base));
+
+	// 逐层2x2盒式滤波，直到1x1，奇数边长时最后一列（行）重复使用
+	while (m_levels.back().width > 1 || m_levels.back().height > 1)
+	{
+		const MipLevel& prev = m_levels.back();
+		MipLevel level = createLevel(std::max(prev.width / 2, 1), std::max(prev.height / 2, 1));
+		for (int y = 0; y < level.height; ++y)
+		{
+			for (int x = 0; x < level.width; ++x)
+			{
+				int x0 = std::min(x * 2, prev.width - 1), x1 = std::min(x * 2 + 1, prev.width - 1);
+				int y0 = std::min(y * 2, prev.height - 1), y1 = std::min(y * 2 + 1, prev.height - 1);
+				uint32_t texels[4] = { _fetch(prev, x0, y0), _fetch(prev, x1, y0), _fetch(prev, x0, y1), _fetch(prev, x1, y1) };
+
+				uint32_t texel = 0;
+				for (int i = 0; i < 4; ++i)
+				{
+					int sum = 2; // 四舍五入
+					for (uint32_t t : texels)
+					{
+						sum += (t >> (i * 8)) & 0xff;
+					}
+					texel |= (uint32_t)(sum / 4) << (i * 8);
+				}
+				_store(level, x, y, texel);
+			}
+		}
+		m_levels.push_back(std::move(level));
+	}
+}
+
+int Texture::width() const
+{
+	return m_levels.empty() ? 0 : m_levels[0].width;
+}
+
+int Texture::height() const
+{
+	return m_levels.empty() ? 0 : m_levels[0].height;
+}
+
+int Texture::levelCount() const
+{
+	return (int)m_levels.size();
+}
+
+float Texture::computeLod(const Vec2f& ddx, const Vec2f& ddy) const
+{
+	if (m_levels.empty())
+		return 0.f;
+
+	// 纹素空间中像素足迹的最大边长，取以2为底的对数
+	float w = (float)m_levels[0].width, h = (float)m_levels[0].height;
+	float lenX = (ddx.x * w) * (ddx.x * w) + (ddx.y * h) * (ddx.y * h);
+	float lenY = (ddy.x * w) * (ddy.x * w) + (ddy.y * h) * (ddy.y * h);
+	float maxLen = std::max(lenX, lenY);
+	if (maxLen <= 1.f)
+		return 0.f;
+
+	return 0.5f * std::log2(maxLen);
+}
+
+TGAColor Texture::sample(const Vec2f& uv, float lod, TextureFilter filter) const
+{
+	if (m_levels.empty())
+		return TGAColor();
+
+	float maxLod = (float)(m_levels.size() - 1);
+	lod = std::clamp(lod, 0.f, maxLod);
+
+	float bgra[4];
+	switch (filter)
+	{
+	case TextureFilter::Nearest:
+		_nearest(m_levels[(int)std::round(lod)], uv, bgra);
+		break;
+	case TextureFilter::Bilinear:
+		_bilinear(m_levels[(int)std::round(lod)], uv, bgra);
+		break;
+	case TextureFilter::Trilinear:
+	{
+		int level0 = (int)lod;
+		int level1 = std::min(level0 + 1, (int)m_levels.size() - 1);
+		float t = lod - level0;
+		float bgra1[4];
+		_bilinear(m_levels[level0], uv, bgra);
+		_bilinear(m_levels[level1], uv, bgra1);
+		for (int i = 0; i < 4; ++i)
+		{
+			bgra[i] += (bgra1[i] - bgra[i]) * t;
+		}
+		break;
+	}
+	}
+
+	return _toColor(bgra);
+}
+
+TGAColor Texture::sampleGrad(const Vec2f& uv, const Vec2f& ddx, const Vec2f& ddy, TextureFilter filter) const
+{
+	return sample(uv, computeLod(ddx, ddy), filter);
+}
+
+uint32_t Texture::_fetch(const MipLevel& level, int x, int y)
+{
+	constexpr int tileMask = (1 << tileShift) - 1;
+	int tile = (x >> tileShift) + (y >> tileShift) * level.tileCols;
+	int offset = spreadBits(x & tileMask) | (spreadBits(y & tileMask) << 1);
+	return level.texels[(tile << (tileShift * 2)) + offset];
+}
+
+void Texture::_store(MipLevel& level, int x, int y, uint32_t texel)
+{
+	constexpr int tileMask = (1 << tileShift) - 1;
+	int tile = (x >> tileShift) + (y >> tileShift) * level.tileCols;
+	int offset = spreadBits(x & tileMask) | (spreadBits(y & tileMask) << 1);
+	level.texels[(tile << (tileShift * 2)) + offset] = texel;
+}
+
+void Texture::_nearest(const MipLevel& level, const Vec2f& uv, float* out) const
+{
+	int x = std::clamp((int)std::floor(uv.x * level.width), 0, level.width - 1);
+	int y = std::clamp((int)std::floor(uv.y * level.height), 0, level.height - 1);
+	unpackTexel(_fetch(level, x, y), out);
+}
+
+void Texture::_bilinear(const MipLevel& level, const Vec2f& uv, float* out) const
+{
+	// 纹素中心在 (i + 0.5) / width
+	float fx = uv.x * level.width - 0.5f;
+	float fy = uv.y * level.height - 0.5f;
+	float floorX = std::floor(fx), floorY = std::floor(fy);
+	float tx = fx - floorX, ty = fy - floorY;
+
+	int x0 = std::clamp((int)floorX, 0, level.width - 1), x1 = std::clamp((int)floorX + 1, 0, level.width - 1);
+	int y0 = std::clamp((int)floorY, 0, level.height - 1), y1 = std::clamp((int)floorY + 1, 0, level.height - 1);
+
+	float c00[4], c10[4], c01[4], c11[4];
+	unpackTexel(_fetch(level, x0, y0), c00);
+	unpackTexel(_fetch(level, x1, y0), c10);
+	unpackTexel(_fetch(level, x0, y1), c01);
+	unpackTexel(_fetch(level, x1, y1), c11);
+	for (int i = 0; i < 4; ++i)
+	{
+		float top = c00[i] + (c10[i] - c00[i]) * tx;
+		float bottom = c01[i] + (c11[i] - c01[i]) * tx;
+		out[i] = top + (bottom - top) * ty;
+	}
+}
+
+TGAColor Texture::_toColor(const float* bgra) const
+{
+	unsigned char bytes[4];
+	for (int i = 0; i < 4; ++i)
+	{
+		bytes[i] = (unsigned char)std::clamp((int)(bgra[i] + 0.5f), 0, 255);
+	}
+
+	return TGAColor(bytes, (unsigned char)m_bytespp);
+}
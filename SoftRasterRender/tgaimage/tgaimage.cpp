@@ -271,6 +271,11 @@ const unsigned char* TGAImage::buffer()
 	return m_imageData.get();
 }
 
+unsigned char* TGAImage::pixels()
+{
+	return m_imageData.get();
+}
+
 void TGAImage::clear()
 {
 	std::fill_n(m_imageData.get(), m_width * m_height * m_bytespp, 0);
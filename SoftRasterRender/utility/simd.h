@@ -0,0 +1,328 @@
+﻿#ifndef __SIMD_H__
+#define __SIMD_H__
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+// 简单的SIMD封装，一次处理4个（SSE）或8个（AVX）float
+// 未开启AVX时vfloat8由两个vfloat4拼成，不支持SSE的平台退化为标量实现
+#if defined(__AVX__)
+#define SIMD_AVX
+#endif
+
+#if defined(__AVX2__)
+#define SIMD_AVX2
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE
+#endif
+
+#if defined(SIMD_AVX)
+#include <immintrin.h>
+#elif defined(SIMD_SSE)
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#define SIMD_INLINE __forceinline
+#else
+#define SIMD_INLINE inline __attribute__((always_inline))
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////
+//                                                                             //
+/////////////////////////////////////////////////////////////////////////////////
+
+// 4路float，比较运算返回每个分量全1或全0的掩码
+struct vfloat4
+{
+	static constexpr int size = 4;
+
+#if defined(SIMD_SSE)
+	__m128 m;
+
+	vfloat4() = default;
+	vfloat4(__m128 v) : m(v) {}
+	explicit vfloat4(float v) : m(_mm_set1_ps(v)) {}
+	vfloat4(float a, float b, float c, float d) : m(_mm_setr_ps(a, b, c, d)) {}
+
+	static SIMD_INLINE vfloat4 load(const float* p) { return _mm_loadu_ps(p); }
+	static SIMD_INLINE vfloat4 loadAligned(const float* p) { return _mm_load_ps(p); }
+	SIMD_INLINE void store(float* p) const { _mm_storeu_ps(p, m); }
+	SIMD_INLINE void storeAligned(float* p) const { _mm_store_ps(p, m); }
+
+	// 掩码的符号位压缩成整数，第i位对应第i个分量
+	SIMD_INLINE int mask() const { return _mm_movemask_ps(m); }
+
+	friend SIMD_INLINE vfloat4 operator+ (const vfloat4& a, const vfloat4& b) { return _mm_add_ps(a.m, b.m); }
+	friend SIMD_INLINE vfloat4 operator- (const vfloat4& a, const vfloat4& b) { return _mm_sub_ps(a.m, b.m); }
+	friend SIMD_INLINE vfloat4 operator* (const vfloat4& a, const vfloat4& b) { return _mm_mul_ps(a.m, b.m); }
+	friend SIMD_INLINE vfloat4 operator/ (const vfloat4& a, const vfloat4& b) { return _mm_div_ps(a.m, b.m); }
+	friend SIMD_INLINE vfloat4 operator& (const vfloat4& a, const vfloat4& b) { return _mm_and_ps(a.m, b.m); }
+	friend SIMD_INLINE vfloat4 operator| (const vfloat4& a, const vfloat4& b) { return _mm_or_ps(a.m, b.m); }
+	friend SIMD_INLINE vfloat4 operator< (const vfloat4& a, const vfloat4& b) { return _mm_cmplt_ps(a.m, b.m); }
+	friend SIMD_INLINE vfloat4 operator<= (const vfloat4& a, const vfloat4& b) { return _mm_cmple_ps(a.m, b.m); }
+	friend SIMD_INLINE vfloat4 operator> (const vfloat4& a, const vfloat4& b) { return _mm_cmpgt_ps(a.m, b.m); }
+	friend SIMD_INLINE vfloat4 operator>= (const vfloat4& a, const vfloat4& b) { return _mm_cmpge_ps(a.m, b.m); }
+	friend SIMD_INLINE vfloat4 vmin(const vfloat4& a, const vfloat4& b) { return _mm_min_ps(a.m, b.m); }
+	friend SIMD_INLINE vfloat4 vmax(const vfloat4& a, const vfloat4& b) { return _mm_max_ps(a.m, b.m); }
+
+	// mask对应分量为真时取a，否则取b
+	friend SIMD_INLINE vfloat4 select(const vfloat4& mask, const vfloat4& a, const vfloat4& b)
+	{
+		return _mm_or_ps(_mm_and_ps(mask.m, a.m), _mm_andnot_ps(mask.m, b.m));
+	}
+#else
+	float m[4];
+
+	vfloat4() = default;
+	explicit vfloat4(float v) { for (int i = 0; i < 4; ++i) m[i] = v; }
+	vfloat4(float a, float b, float c, float d) { m[0] = a; m[1] = b; m[2] = c; m[3] = d; }
+
+	static vfloat4 load(const float* p) { vfloat4 r; for (int i = 0; i < 4; ++i) r.m[i] = p[i]; return r; }
+	static vfloat4 loadAligned(const float* p) { return load(p); }
+	void store(float* p) const { for (int i = 0; i < 4; ++i) p[i] = m[i]; }
+	void storeAligned(float* p) const { store(p); }
+
+	int mask() const
+	{
+		int bits = 0;
+		for (int i = 0; i < 4; ++i) bits |= (std::signbit(m[i]) ? 1 : 0) << i;
+		return bits;
+	}
+
+#define SIMD_SCALAR_OP(op, expr) \
+	friend vfloat4 op(const vfloat4& a, const vfloat4& b) { vfloat4 r; for (int i = 0; i < 4; ++i) r.m[i] = (expr); return r; }
+#define SIMD_SCALAR_CMP(op, cmp) \
+	friend vfloat4 op(const vfloat4& a, const vfloat4& b) { vfloat4 r; for (int i = 0; i < 4; ++i) r.m[i] = _fromBits((a.m[i] cmp b.m[i]) ? 0xffffffffu : 0u); return r; }
+
+	SIMD_SCALAR_OP(operator+, a.m[i] + b.m[i])
+	SIMD_SCALAR_OP(operator-, a.m[i] - b.m[i])
+	SIMD_SCALAR_OP(operator*, a.m[i] * b.m[i])
+	SIMD_SCALAR_OP(operator/, a.m[i] / b.m[i])
+	SIMD_SCALAR_OP(operator&, _fromBits(_toBits(a.m[i]) & _toBits(b.m[i])))
+	SIMD_SCALAR_OP(operator|, _fromBits(_toBits(a.m[i]) | _toBits(b.m[i])))
+	SIMD_SCALAR_OP(vmin, std::min(a.m[i], b.m[i]))
+	SIMD_SCALAR_OP(vmax, std::max(a.m[i], b.m[i]))
+	SIMD_SCALAR_CMP(operator<, <)
+	SIMD_SCALAR_CMP(operator<=, <=)
+	SIMD_SCALAR_CMP(operator>, >)
+	SIMD_SCALAR_CMP(operator>=, >=)
+
+#undef SIMD_SCALAR_OP
+#undef SIMD_SCALAR_CMP
+
+	friend vfloat4 select(const vfloat4& mask, const vfloat4& a, const vfloat4& b)
+	{
+		vfloat4 r;
+		for (int i = 0; i < 4; ++i) r.m[i] = _toBits(mask.m[i]) ? a.m[i] : b.m[i];
+		return r;
+	}
+
+private:
+	static uint32_t _toBits(float v) { uint32_t bits; std::memcpy(&bits, &v, sizeof(bits)); return bits; }
+	static float _fromBits(uint32_t bits) { float v; std::memcpy(&v, &bits, sizeof(v)); return v; }
+public:
+#endif
+
+	// 各分量依次为0,1,2,3，用于按列步进
+	static SIMD_INLINE vfloat4 lanes() { return vfloat4(0.f, 1.f, 2.f, 3.f); }
+};
+
+/////////////////////////////////////////////////////////////////////////////////
+//                                                                             //
+/////////////////////////////////////////////////////////////////////////////////
+
+// 8路float
+struct vfloat8
+{
+	static constexpr int size = 8;
+
+#if defined(SIMD_AVX)
+	__m256 m;
+
+	vfloat8() = default;
+	vfloat8(__m256 v) : m(v) {}
+	explicit vfloat8(float v) : m(_mm256_set1_ps(v)) {}
+
+	static SIMD_INLINE vfloat8 load(const float* p) { return _mm256_loadu_ps(p); }
+	static SIMD_INLINE vfloat8 loadAligned(const float* p) { return _mm256_load_ps(p); }
+	SIMD_INLINE void store(float* p) const { _mm256_storeu_ps(p, m); }
+	SIMD_INLINE void storeAligned(float* p) const { _mm256_store_ps(p, m); }
+	SIMD_INLINE int mask() const { return _mm256_movemask_ps(m); }
+
+	friend SIMD_INLINE vfloat8 operator+ (const vfloat8& a, const vfloat8& b) { return _mm256_add_ps(a.m, b.m); }
+	friend SIMD_INLINE vfloat8 operator- (const vfloat8& a, const vfloat8& b) { return _mm256_sub_ps(a.m, b.m); }
+	friend SIMD_INLINE vfloat8 operator* (const vfloat8& a, const vfloat8& b) { return _mm256_mul_ps(a.m, b.m); }
+	friend SIMD_INLINE vfloat8 operator/ (const vfloat8& a, const vfloat8& b) { return _mm256_div_ps(a.m, b.m); }
+	friend SIMD_INLINE vfloat8 operator& (const vfloat8& a, const vfloat8& b) { return _mm256_and_ps(a.m, b.m); }
+	friend SIMD_INLINE vfloat8 operator| (const vfloat8& a, const vfloat8& b) { return _mm256_or_ps(a.m, b.m); }
+	friend SIMD_INLINE vfloat8 operator< (const vfloat8& a, const vfloat8& b) { return _mm256_cmp_ps(a.m, b.m, _CMP_LT_OQ); }
+	friend SIMD_INLINE vfloat8 operator<= (const vfloat8& a, const vfloat8& b) { return _mm256_cmp_ps(a.m, b.m, _CMP_LE_OQ); }
+	friend SIMD_INLINE vfloat8 operator> (const vfloat8& a, const vfloat8& b) { return _mm256_cmp_ps(a.m, b.m, _CMP_GT_OQ); }
+	friend SIMD_INLINE vfloat8 operator>= (const vfloat8& a, const vfloat8& b) { return _mm256_cmp_ps(a.m, b.m, _CMP_GE_OQ); }
+	friend SIMD_INLINE vfloat8 vmin(const vfloat8& a, const vfloat8& b) { return _mm256_min_ps(a.m, b.m); }
+	friend SIMD_INLINE vfloat8 vmax(const vfloat8& a, const vfloat8& b) { return _mm256_max_ps(a.m, b.m); }
+
+	friend SIMD_INLINE vfloat8 select(const vfloat8& mask, const vfloat8& a, const vfloat8& b)
+	{
+		return _mm256_blendv_ps(b.m, a.m, mask.m);
+	}
+
+	static SIMD_INLINE vfloat8 lanes() { return _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f); }
+#else
+	vfloat4 lo;
+	vfloat4 hi;
+
+	vfloat8() = default;
+	vfloat8(const vfloat4& l, const vfloat4& h) : lo(l), hi(h) {}
+	explicit vfloat8(float v) : lo(v), hi(v) {}
+
+	static SIMD_INLINE vfloat8 load(const float* p) { return vfloat8(vfloat4::load(p), vfloat4::load(p + 4)); }
+	static SIMD_INLINE vfloat8 loadAligned(const float* p) { return vfloat8(vfloat4::loadAligned(p), vfloat4::loadAligned(p + 4)); }
+	SIMD_INLINE void store(float* p) const { lo.store(p); hi.store(p + 4); }
+	SIMD_INLINE void storeAligned(float* p) const { lo.storeAligned(p); hi.storeAligned(p + 4); }
+	SIMD_INLINE int mask() const { return lo.mask() | (hi.mask() << 4); }
+
+#define SIMD_PAIR_OP(op) \
+	friend SIMD_INLINE vfloat8 op(const vfloat8& a, const vfloat8& b) { return vfloat8(op(a.lo, b.lo), op(a.hi, b.hi)); }
+
+	SIMD_PAIR_OP(operator+)
+	SIMD_PAIR_OP(operator-)
+	SIMD_PAIR_OP(operator*)
+	SIMD_PAIR_OP(operator/)
+	SIMD_PAIR_OP(operator&)
+	SIMD_PAIR_OP(operator|)
+	SIMD_PAIR_OP(operator<)
+	SIMD_PAIR_OP(operator<=)
+	SIMD_PAIR_OP(operator>)
+	SIMD_PAIR_OP(operator>=)
+	SIMD_PAIR_OP(vmin)
+	SIMD_PAIR_OP(vmax)
+
+#undef SIMD_PAIR_OP
+
+	friend SIMD_INLINE vfloat8 select(const vfloat8& mask, const vfloat8& a, const vfloat8& b)
+	{
+		return vfloat8(select(mask.lo, a.lo, b.lo), select(mask.hi, a.hi, b.hi));
+	}
+
+	static SIMD_INLINE vfloat8 lanes() { return vfloat8(vfloat4::lanes(), vfloat4::lanes() + vfloat4(4.f)); }
+#endif
+};
+
+/////////////////////////////////////////////////////////////////////////////////
+//                                                                             //
+/////////////////////////////////////////////////////////////////////////////////
+
+// 4路int32，只提供光栅化整数边函数需要的运算
+struct vint4
+{
+	static constexpr int size = 4;
+
+#if defined(SIMD_SSE)
+	__m128i m;
+
+	vint4() = default;
+	vint4(__m128i v) : m(v) {}
+	explicit vint4(int v) : m(_mm_set1_epi32(v)) {}
+
+	// 各分量依次为base, base + step, base + 2 * step, ...
+	static SIMD_INLINE vint4 ramp(int base, int step) { return _mm_setr_epi32(base, base + step, base + step * 2, base + step * 3); }
+
+	SIMD_INLINE int mask() const { return _mm_movemask_ps(_mm_castsi128_ps(m)); }
+	SIMD_INLINE vfloat4 toFloat() const { return _mm_cvtepi32_ps(m); }
+
+	friend SIMD_INLINE vint4 operator+ (const vint4& a, const vint4& b) { return _mm_add_epi32(a.m, b.m); }
+	friend SIMD_INLINE vint4 operator& (const vint4& a, const vint4& b) { return _mm_and_si128(a.m, b.m); }
+	friend SIMD_INLINE vint4 operator> (const vint4& a, const vint4& b) { return _mm_cmpgt_epi32(a.m, b.m); }
+#else
+	int32_t m[4];
+
+	vint4() = default;
+	explicit vint4(int v) { for (int i = 0; i < 4; ++i) m[i] = v; }
+
+	static vint4 ramp(int base, int step) { vint4 r; for (int i = 0; i < 4; ++i) r.m[i] = base + step * i; return r; }
+
+	int mask() const
+	{
+		int bits = 0;
+		for (int i = 0; i < 4; ++i) bits |= (m[i] < 0 ? 1 : 0) << i;
+		return bits;
+	}
+
+	vfloat4 toFloat() const { return vfloat4((float)m[0], (float)m[1], (float)m[2], (float)m[3]); }
+
+	friend vint4 operator+ (const vint4& a, const vint4& b) { vint4 r; for (int i = 0; i < 4; ++i) r.m[i] = a.m[i] + b.m[i]; return r; }
+	friend vint4 operator& (const vint4& a, const vint4& b) { vint4 r; for (int i = 0; i < 4; ++i) r.m[i] = a.m[i] & b.m[i]; return r; }
+	friend vint4 operator> (const vint4& a, const vint4& b) { vint4 r; for (int i = 0; i < 4; ++i) r.m[i] = a.m[i] > b.m[i] ? -1 : 0; return r; }
+#endif
+};
+
+/////////////////////////////////////////////////////////////////////////////////
+//                                                                             //
+/////////////////////////////////////////////////////////////////////////////////
+
+// 8路int32，没有AVX2时由两个vint4拼成
+struct vint8
+{
+	static constexpr int size = 8;
+
+#if defined(SIMD_AVX2)
+	__m256i m;
+
+	vint8() = default;
+	vint8(__m256i v) : m(v) {}
+	explicit vint8(int v) : m(_mm256_set1_epi32(v)) {}
+
+	static SIMD_INLINE vint8 ramp(int base, int step)
+	{
+		return _mm256_add_epi32(_mm256_set1_epi32(base), _mm256_mullo_epi32(_mm256_set1_epi32(step), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+	}
+
+	SIMD_INLINE int mask() const { return _mm256_movemask_ps(_mm256_castsi256_ps(m)); }
+	SIMD_INLINE vfloat8 toFloat() const { return _mm256_cvtepi32_ps(m); }
+
+	friend SIMD_INLINE vint8 operator+ (const vint8& a, const vint8& b) { return _mm256_add_epi32(a.m, b.m); }
+	friend SIMD_INLINE vint8 operator& (const vint8& a, const vint8& b) { return _mm256_and_si256(a.m, b.m); }
+	friend SIMD_INLINE vint8 operator> (const vint8& a, const vint8& b) { return _mm256_cmpgt_epi32(a.m, b.m); }
+#else
+	vint4 lo;
+	vint4 hi;
+
+	vint8() = default;
+	vint8(const vint4& l, const vint4& h) : lo(l), hi(h) {}
+	explicit vint8(int v) : lo(v), hi(v) {}
+
+	static SIMD_INLINE vint8 ramp(int base, int step) { return vint8(vint4::ramp(base, step), vint4::ramp(base + step * 4, step)); }
+
+	SIMD_INLINE int mask() const { return lo.mask() | (hi.mask() << 4); }
+#if defined(SIMD_AVX)
+	SIMD_INLINE vfloat8 toFloat() const { return _mm256_cvtepi32_ps(_mm256_setr_m128i(lo.m, hi.m)); }
+#else
+	SIMD_INLINE vfloat8 toFloat() const { return vfloat8(lo.toFloat(), hi.toFloat()); }
+#endif
+
+	friend SIMD_INLINE vint8 operator+ (const vint8& a, const vint8& b) { return vint8(a.lo + b.lo, a.hi + b.hi); }
+	friend SIMD_INLINE vint8 operator& (const vint8& a, const vint8& b) { return vint8(a.lo & b.lo, a.hi & b.hi); }
+	friend SIMD_INLINE vint8 operator> (const vint8& a, const vint8& b) { return vint8(a.lo > b.lo, a.hi > b.hi); }
+#endif
+};
+
+/////////////////////////////////////////////////////////////////////////////////
+//                                                                             //
+/////////////////////////////////////////////////////////////////////////////////
+
+// 当前平台最宽的float向量，以及同宽度的int32向量
+#if defined(SIMD_AVX)
+using vfloat = vfloat8;
+using vint = vint8;
+#else
+using vfloat = vfloat4;
+using vint = vint4;
+#endif
+
+#endif // !__SIMD_H__